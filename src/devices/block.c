@@ -3,7 +3,17 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Buckets in a request latency histogram.  Bucket I counts
+   latencies of [2**I, 2**(I+1)) ns; the last bucket also counts
+   anything longer. */
+#define LATENCY_BUCKETS 32
 
 /* A block device. */
 struct block
@@ -19,6 +29,30 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request statistics, protected by queue_lock.  Latency and
+       queue depth are only measured on devices that have a
+       queue. */
+    unsigned long long read_reqs;       /* Read requests submitted. */
+    unsigned long long write_reqs;      /* Write requests submitted. */
+    unsigned long long seq_reqs;        /* Requests that started where
+                                           the previous one ended. */
+    block_sector_t last_end;            /* Sector after last request. */
+    unsigned long long latency[LATENCY_BUCKETS]; /* Submit to completion
+                                                    latency histogram. */
+    long long latency_ns;               /* Sum of all latencies. */
+    size_t depth;                       /* Requests queued or in flight. */
+    size_t peak_depth;                  /* Maximum depth. */
+
+    /* Request queue.  See "Request queues" below. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_nonempty;    /* Signaled when a request is
+                                           queued. */
+    struct list queue;                  /* Pending requests, by sector. */
+    unsigned next_seq;                  /* Next request sequence number. */
+    block_sector_t head;                /* Sector after last dispatched. */
+    bool worker_started;                /* Has the worker been started? */
+    uint8_t *bounce;                    /* Buffer for merged requests. */
   };
 
 /* List of all block devices. */
@@ -113,6 +147,46 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR are all
+   within BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  check_sector (block, sector);
+  if (cnt > block->size - sector)
+    check_sector (block, block->size);
+}
+
+/* Completion function for block_transfer(). */
+static void
+wake_submitter (struct block_request *r) 
+{
+  sema_up (r->aux);
+}
+
+/* Submits a request to transfer CNT sectors starting at SECTOR
+   between BLOCK and BUFFER and waits for it to complete. */
+static void
+block_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                void *buffer, bool write)
+{
+  struct block_request r;
+  struct semaphore done;
+
+  if (cnt == 0)
+    return;
+
+  sema_init (&done, 0);
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffer = buffer;
+  r.write = write;
+  r.complete = wake_submitter;
+  r.aux = &done;
+  block_submit (block, &r);
+  sema_down (&done);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +194,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_transfer (block, sector, 1, buffer, false);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +205,337 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_transfer (block, sector, 1, (void *) buffer, true);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Uses the driver's multiple-sector transfer if it has
+   one, which is much faster than reading the sectors one by one.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multi (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  block_transfer (block, sector, cnt, buffer, false);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  Uses the driver's multiple-sector transfer if it
+   has one.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multi (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer)
+{
+  block_transfer (block, sector, cnt, (void *) buffer, true);
+}
+
+/* Request queues.
+
+   Each block device that has a driver of its own (rather than
+   passing requests on through a submit operation) has a queue of
+   pending requests, kept in order of sector number, and a worker
+   thread that is started by the first request.  The worker
+   dispatches requests to the driver one at a time in C-LOOK
+   order: it takes the lowest-numbered request at or after the
+   sector just past the previous one, and wraps around to the
+   lowest-numbered request when there is none, so the disk head
+   sweeps in one direction.
+
+   The worker merges a request with the pending requests in the
+   same direction that continue it, up to MERGE_SECTORS in all,
+   into one driver call through a bounce buffer.
+
+   Reordering must not change the outcome of requests that
+   overlap, if either is a write, so a request is never
+   dispatched ahead of an older one that it conflicts with. */
+
+/* Size of each worker's bounce buffer, in pages and in
+   sectors. */
+#define MERGE_PAGES 8
+#define MERGE_SECTORS (MERGE_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Returns true if request A's first sector precedes request
+   B's. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED) 
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Returns true if requests A and B must complete in submission
+   order, because they overlap and at least one is a write. */
+static bool
+requests_conflict (const struct block_request *a,
+                   const struct block_request *b) 
+{
+  return ((a->write || b->write)
+          && a->sector < b->sector + b->cnt
+          && b->sector < a->sector + a->cnt);
+}
+
+/* Returns true if request A was submitted before request B.
+   Sequence numbers wrap around, so compare their difference. */
+static bool
+submitted_before (const struct block_request *a,
+                  const struct block_request *b) 
+{
+  return (int) (a->seq - b->seq) < 0;
+}
+
+/* Returns a request in BLOCK's queue that was submitted before R
+   and conflicts with it, or a null pointer if R may be
+   dispatched now. */
+static struct block_request *
+older_conflict (struct block *block, const struct block_request *r) 
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *q = list_entry (e, struct block_request, elem);
+      if (submitted_before (q, r) && requests_conflict (q, r))
+        return q;
+    }
+  return NULL;
+}
+
+/* Removes the next requests to dispatch from BLOCK's nonempty
+   queue, in C-LOOK order and merged as described above, and
+   appends them to BATCH in sector order.  Returns the total
+   number of sectors. */
+static size_t
+take_batch (struct block *block, struct list *batch) 
+{
+  struct block_request *r = NULL, *older;
+  struct list_elem *e;
+  block_sector_t end;
+  size_t cnt;
+
+  ASSERT (!list_empty (&block->queue));
+
+  /* C-LOOK: the first request at or past the head, else the
+     first request. */
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head)
+        break;
+    }
+  if (e == list_end (&block->queue))
+    r = list_entry (list_begin (&block->queue), struct block_request, elem);
+  while ((older = older_conflict (block, r)) != NULL)
+    r = older;
+
+  /* Merge the requests that continue R. */
+  e = list_remove (&r->elem);
+  list_push_back (batch, &r->elem);
+  end = r->sector + r->cnt;
+  cnt = r->cnt;
+  while (block->bounce != NULL && e != list_end (&block->queue))
+    {
+      struct block_request *q = list_entry (e, struct block_request, elem);
+
+      if (q->sector > end)
+        break;
+      if (q->sector == end && q->write == r->write
+          && cnt + q->cnt <= MERGE_SECTORS
+          && older_conflict (block, q) == NULL)
+        {
+          e = list_remove (&q->elem);
+          list_push_back (batch, &q->elem);
+          end += q->cnt;
+          cnt += q->cnt;
+        }
+      else
+        e = list_next (e);
+    }
+
+  block->head = end;
+  return cnt;
+}
+
+/* Transfers CNT sectors starting at SECTOR between BLOCK and
+   BUFFER with BLOCK's driver. */
+static void
+drive (struct block *block, block_sector_t sector, size_t cnt,
+       uint8_t *buffer, bool write) 
+{
+  size_t i;
+
+  if (write)
+    {
+      if (block->ops->write_multi != NULL)
+        block->ops->write_multi (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->write (block->aux, sector + i,
+                             buffer + i * BLOCK_SECTOR_SIZE);
+    }
+  else
+    {
+      if (block->ops->read_multi != NULL)
+        block->ops->read_multi (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->read (block->aux, sector + i,
+                            buffer + i * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Carries out the requests in BATCH, which take_batch()
+   returned along with their total sector count CNT, and
+   completes them. */
+static void
+dispatch (struct block *block, struct list *batch, size_t cnt) 
+{
+  struct block_request *first = list_entry (list_front (batch),
+                                            struct block_request, elem);
+  struct list_elem *e;
+  uint8_t *p = block->bounce;
+  int64_t now;
+
+  if (list_size (batch) == 1)
+    drive (block, first->sector, cnt, first->buffer, first->write);
+  else
+    {
+      /* Gather the data to write into the bounce buffer, or
+         scatter the data read out of it. */
+      if (first->write)
+        for (e = list_begin (batch); e != list_end (batch);
+             e = list_next (e))
+          {
+            struct block_request *r = list_entry (e, struct block_request,
+                                                  elem);
+            memcpy (p, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+            p += r->cnt * BLOCK_SECTOR_SIZE;
+          }
+      drive (block, first->sector, cnt, block->bounce, first->write);
+      if (!first->write)
+        for (e = list_begin (batch); e != list_end (batch);
+             e = list_next (e))
+          {
+            struct block_request *r = list_entry (e, struct block_request,
+                                                  elem);
+            memcpy (r->buffer, p, r->cnt * BLOCK_SECTOR_SIZE);
+            p += r->cnt * BLOCK_SECTOR_SIZE;
+          }
+    }
+
+  /* Record the requests' latencies.  A completion function may
+     free its request, so this must come first. */
+  now = timer_now_ns ();
+  lock_acquire (&block->queue_lock);
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      int64_t latency = now - r->submit_ns;
+      int bucket = latency > 1 ? 63 - __builtin_clzll (latency) : 0;
+
+      block->latency[bucket < LATENCY_BUCKETS ? bucket
+                     : LATENCY_BUCKETS - 1]++;
+      block->latency_ns += latency;
+      block->depth--;
+    }
+  lock_release (&block->queue_lock);
+
+  /* Take each request off the list before completing it. */
+  while (!list_empty (batch))
+    {
+      struct block_request *r = list_entry (list_pop_front (batch),
+                                            struct block_request, elem);
+      r->complete (r);
+    }
+}
+
+/* Worker thread for BLOCK_: dispatches its queued requests
+   forever. */
+static void
+block_worker (void *block_) 
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct list batch;
+      size_t cnt;
+
+      list_init (&batch);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->queue_lock);
+      cnt = take_batch (block, &batch);
+      lock_release (&block->queue_lock);
+
+      dispatch (block, &batch, cnt);
+    }
+}
+
+/* Submits request R to BLOCK and returns without waiting for it.
+   R->complete will be called on R, from a kernel thread, once
+   the transfer is done; it should not block for long, because
+   it holds up the device's other requests.
+   Panics if R lies outside BLOCK. */
+void
+block_submit (struct block *block, struct block_request *r) 
+{
+  ASSERT (r->cnt > 0);
+  ASSERT (r->complete != NULL);
+
+  check_sectors (block, r->sector, r->cnt);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  lock_acquire (&block->queue_lock);
+  if (r->write)
+    {
+      block->write_cnt += r->cnt;
+      block->write_reqs++;
+    }
+  else
+    {
+      block->read_cnt += r->cnt;
+      block->read_reqs++;
+    }
+  if (r->sector == block->last_end)
+    block->seq_reqs++;
+  block->last_end = r->sector + r->cnt;
+
+  if (block->ops->submit != NULL)
+    {
+      lock_release (&block->queue_lock);
+      block->ops->submit (block->aux, r);
+      return;
+    }
+
+  if (!block->worker_started)
+    {
+      char name[sizeof block->name + 3];
+
+      /* Without a bounce buffer, requests are not merged. */
+      block->bounce = palloc_get_multiple (0, MERGE_PAGES);
+      snprintf (name, sizeof name, "%s-io", block->name);
+      if (thread_create (name, PRI_MAX, block_worker, block) == TID_ERROR)
+        PANIC ("%s: can't start I/O thread", block->name);
+      block->worker_started = true;
+    }
+  r->seq = block->next_seq++;
+  r->submit_ns = timer_now_ns ();
+  if (++block->depth > block->peak_depth)
+    block->peak_depth = block->depth;
+  list_insert_ordered (&block->queue, &r->elem, request_less, NULL);
+  cond_signal (&block->queue_nonempty, &block->queue_lock);
+  lock_release (&block->queue_lock);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,20 +559,54 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints statistics for each block device used for a Pintos
+   role: sectors read and written and, if the device has seen any
+   requests, the request counts, the bytes transferred, the share
+   of sequential requests and, for devices with a queue, the peak
+   queue depth and a log2 histogram of request latency.
+   Does not lock the devices, because it may be called from a
+   panic, so the numbers may be slightly inconsistent if I/O is
+   in progress. */
 void
 block_print_stats (void)
 {
-  int i;
+  int i, j;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
     {
       struct block *block = block_by_role[i];
-      if (block != NULL)
+      unsigned long long reqs, done;
+
+      if (block == NULL)
+        continue;
+
+      printf ("%s (%s): %llu reads, %llu writes\n",
+              block->name, block_type_name (block->type),
+              block->read_cnt, block->write_cnt);
+
+      reqs = block->read_reqs + block->write_reqs;
+      if (reqs > 0)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
-                  block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+          printf ("  %llu read requests (%llu bytes), "
+                  "%llu write requests (%llu bytes), %llu%% sequential\n",
+                  block->read_reqs, block->read_cnt * BLOCK_SECTOR_SIZE,
+                  block->write_reqs, block->write_cnt * BLOCK_SECTOR_SIZE,
+                  block->seq_reqs * 100 / reqs);
+
+          done = 0;
+          for (j = 0; j < LATENCY_BUCKETS; j++)
+            done += block->latency[j];
+          if (done > 0)
+            {
+              printf ("  peak queue depth %zu, mean latency %lld us\n",
+                      block->peak_depth, block->latency_ns / done / 1000);
+              printf ("  latency (ns):");
+              for (j = 0; j < LATENCY_BUCKETS; j++)
+                if (block->latency[j] != 0)
+                  printf (" %s%llu:%llu", j == LATENCY_BUCKETS - 1 ? ">=" : "",
+                          1ULL << j, block->latency[j]);
+              printf ("\n");
+            }
         }
     }
 }
@@ -200,6 +633,18 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->read_reqs = block->write_reqs = block->seq_reqs = 0;
+  block->last_end = 0;
+  memset (block->latency, 0, sizeof block->latency);
+  block->latency_ns = 0;
+  block->depth = block->peak_depth = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_nonempty);
+  list_init (&block->queue);
+  block->next_seq = 0;
+  block->head = 0;
+  block->worker_started = false;
+  block->bounce = NULL;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
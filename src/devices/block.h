@@ -1,6 +1,8 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <list.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -53,9 +55,38 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multi (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multi (struct block *, block_sector_t, size_t cnt,
+                        const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests. */
+
+struct block_request;
+typedef void block_complete_func (struct block_request *);
+
+/* A request to transfer CNT consecutive sectors starting at
+   SECTOR between a block device and BUFFER.  The submitter owns
+   the request and BUFFER, and must keep both alive, until
+   COMPLETE is called on the request. */
+struct block_request
+  {
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors, at least 1. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* Write to device (true) or read (false)? */
+    block_complete_func *complete; /* Called when done. */
+    void *aux;                  /* For use by COMPLETE. */
+
+    /* Owned by the block layer while the request is pending. */
+    struct list_elem elem;      /* Element in a device queue. */
+    unsigned seq;               /* Submission order. */
+    int64_t submit_ns;          /* Time of submission. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -65,6 +96,21 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional: transfer CNT consecutive sectors at once.  If
+       null, the block layer calls read or write once per
+       sector. */
+    void (*read_multi) (void *aux, block_sector_t, size_t cnt,
+                        void *buffer);
+    void (*write_multi) (void *aux, block_sector_t, size_t cnt,
+                         const void *buffer);
+
+    /* Optional: passes a request on to another device, for
+       stacked devices such as partitions that need no queue of
+       their own.  May change the request's sector.  If null, the
+       block layer queues requests for the device and calls read,
+       write, read_multi and write_multi on them. */
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
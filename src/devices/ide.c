@@ -9,9 +9,15 @@
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   If a PCI IDE controller capable of bus mastering is found,
+   sectors are transferred by DMA, following the "Programming
+   Interface for Bus Master IDE Controller" specification, and
+   otherwise by programmed I/O. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -34,6 +40,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +56,46 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors that one READ MULTIPLE or WRITE MULTIPLE command
+   can transfer.  A sector count of 0 in the Sector Count
+   register means 256. */
+#define MAX_MULTI_SECTORS 256
+
+/* Bus master IDE port addresses. */
+#define bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)    /* Command. */
+#define bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)     /* Status. */
+#define bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)       /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop bus master. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error (write 1 to clear). */
+#define BM_STA_IRQ 0x04         /* Interrupt (write 1 to clear). */
+#define BM_STA_DMA0 0x20        /* Device 0 is DMA capable. */
+
+/* A physical region descriptor, which tells the bus master one
+   physically contiguous region of memory to transfer.  A region
+   may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, even. */
+    uint16_t size;              /* Size in bytes, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Descriptors in a channel's PRD table.  A transfer of
+   MAX_MULTI_SECTORS sectors (128 kB) crosses at most two 64 kB
+   boundaries, so it needs at most 3. */
+#define PRD_CNT 4
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +104,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multi_cnt;              /* Sectors per DRQ block in READ/WRITE
+                                   MULTIPLE, or 0 if unsupported. */
+    bool use_dma;               /* Transfer by bus-master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +122,14 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base I/O port, or 0 if the
+                                   channel can only do PIO. */
+
+    /* PRD table.  Aligning it to its own size keeps it within
+       one 64 kB region, as the bus master requires. */
+    struct prd prdt[PRD_CNT]
+      __attribute__ ((aligned (sizeof (struct prd) * PRD_CNT)));
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,14 +139,18 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int max_cnt);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          uint8_t *buffer, bool writing);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -101,8 +163,14 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
+  if (bm_base != 0)
+    printf ("ide: bus master at port 0x%"PRIx16", using DMA\n", bm_base);
+  else
+    printf ("ide: no bus master found, using PIO\n");
+
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
       struct channel *c = &channels[chan_no];
@@ -126,6 +194,7 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +205,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multi_cnt = 0;
+          d->use_dma = false;
         }
 
       /* Register interrupt handler. */
@@ -155,6 +226,83 @@ ide_init (void)
     }
 }
 
+/* Bus master detection. */
+
+/* PCI configuration space ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Returns the 32-bit PCI configuration register at byte offset
+   REG of function FUNC of device DEV on bus BUS. */
+static uint32_t
+pci_config_read (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS, (0x80000000 | (bus << 16) | (dev << 11)
+                             | (func << 8) | (reg & 0xfc)));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit PCI configuration register at byte
+   offset REG of function FUNC of device DEV on bus BUS. */
+static void
+pci_config_write (int bus, int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDRESS, (0x80000000 | (bus << 16) | (dev << 11)
+                             | (func << 8) | (reg & 0xfc)));
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Scans the PCI buses for an IDE controller that supports bus
+   mastering, such as the PIIX3 that QEMU emulates.  If one is
+   found, enables bus mastering in it and returns the base I/O
+   port of its bus master registers (BAR4), which control the
+   primary channel at the base port and the secondary channel 8
+   ports above.  Returns 0 if none is found.
+
+   We only drive the legacy channels, so a controller that is in
+   native-PCI mode is of no use either. */
+static uint16_t
+find_bus_master (void) 
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++)
+        {
+          uint32_t id = pci_config_read (bus, dev, func, 0x00);
+          uint32_t class, bar4;
+
+          if ((id & 0xffff) == 0xffff)
+            {
+              /* No such function.  If function 0 is missing, so
+                 is the device. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          /* Class 01h (mass storage), subclass 01h (IDE),
+             programming interface with bit 7 (bus master) set
+             and bits 0 and 2 (native-PCI mode) clear. */
+          class = pci_config_read (bus, dev, func, 0x08) >> 8;
+          if ((class >> 8) != 0x0101 || !(class & 0x80) || (class & 0x05))
+            continue;
+
+          /* BAR4 must be an I/O space address. */
+          bar4 = pci_config_read (bus, dev, func, 0x20);
+          if (!(bar4 & 1) || (bar4 & 0xfff0) == 0)
+            continue;
+
+          /* Enable I/O space (bit 0) and bus master (bit 2) in the
+             command register. */
+          pci_config_write (bus, dev, func, 0x04,
+                            pci_config_read (bus, dev, func, 0x04) | 0x5);
+          return bar4 & 0xfff0;
+        }
+  return 0;
+}
+
 /* Disk detection and identification. */
 
 static char *descramble_ata_string (char *, int size);
@@ -303,12 +451,54 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Word 47 bits 7:0 give the most sectors the disk can
+     transfer per interrupt in READ MULTIPLE and WRITE
+     MULTIPLE. */
+  set_multiple_mode (d, *(uint16_t *) &id[47 * 2] & 0xff);
+
+  /* Use DMA if the channel has a bus master and word 49 bit 8
+     says that the disk supports DMA.  Setting the "DMA capable"
+     bit in the bus master status register is only a hint to
+     other software, but it is polite. */
+  if (c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100))
+    {
+      d->use_dma = true;
+      outb (bm_status (c), ((inb (bm_status (c)) & ~(BM_STA_ERR | BM_STA_IRQ))
+                            | (BM_STA_DMA0 << d->dev_no)));
+    }
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Enables READ MULTIPLE and WRITE MULTIPLE on disk D with
+   MAX_CNT sectors per DRQ block, the most that D supports
+   according to IDENTIFY DEVICE, and sets D's multi_cnt
+   accordingly.  If MAX_CNT is 0 or D rejects the command, D is
+   left using one-sector commands. */
+static void
+set_multiple_mode (struct ata_disk *d, int max_cnt) 
+{
+  struct channel *c = d->channel;
+
+  d->multi_cnt = 0;
+  if (max_cnt == 0)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), max_cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (inb (reg_alt_status (c)) & STA_ERR)
+    printf ("%s: SET MULTIPLE MODE failed, using single-sector "
+            "transfers\n", d->name);
+  else
+    d->multi_cnt = max_cnt;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +527,156 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER
+   with PIO, which D's channel must already be locked for.  Uses
+   READ MULTIPLE, which interrupts once per DRQ block of D's
+   multi_cnt sectors, if D supports it, otherwise READ SECTOR,
+   which interrupts once per sector. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  size_t per_block = d->multi_cnt > 0 ? (size_t) d->multi_cnt : 1;
+  size_t done, i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multi_cnt > 0 ? CMD_READ_MULTIPLE
+                         : CMD_READ_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += i)
+    {
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (i = 0; i < per_block && done + i < cnt; i++)
+        input_sector (c, buffer + (done + i) * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER
+   with PIO, using WRITE MULTIPLE or WRITE SECTOR as pio_read()
+   uses READ MULTIPLE or READ SECTOR.  D's channel must already
+   be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  size_t per_block = d->multi_cnt > 0 ? (size_t) d->multi_cnt : 1;
+  size_t done, i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multi_cnt > 0 ? CMD_WRITE_MULTIPLE
+                         : CMD_WRITE_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += i)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (i = 0; i < per_block && done + i < cnt; i++)
+        output_sector (c, buffer + (done + i) * BLOCK_SECTOR_SIZE);
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Each
+   command transfers up to MAX_MULTI_SECTORS sectors, by
+   bus-master DMA if possible and by PIO otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multi (void *d_, block_sector_t sec_no, size_t cnt, void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_MULTI_SECTORS ? cnt : MAX_MULTI_SECTORS;
+      if (!dma_transfer (d, sec_no, cmd_cnt, buffer, false))
+        pio_read (d, sec_no, cmd_cnt, buffer);
+      sec_no += cmd_cnt;
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes, as
+   ide_read_multi() reads them.  Returns after the disk has
    acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multi (void *d_, block_sector_t sec_no, size_t cnt,
+                 const void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_MULTI_SECTORS ? cnt : MAX_MULTI_SECTORS;
+      if (!dma_transfer (d, sec_no, cmd_cnt, (uint8_t *) buffer, true))
+        pio_write (d, sec_no, cmd_cnt, buffer);
+      sec_no += cmd_cnt;
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multi (d, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multi (d, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multi,
+    ide_write_multi,
+    NULL
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between
+   1 and MAX_MULTI_SECTORS, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_MULTI_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_MULTI_SECTORS ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +713,81 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Transfers CNT sectors, at most MAX_MULTI_SECTORS, starting at
+   SEC_NO between disk D and BUFFER by bus-master DMA, in the
+   direction given by WRITING.  D's channel must already be
+   locked.  Returns true if successful, false if D does not use
+   DMA or BUFFER cannot be described to the bus master, in which
+   case the caller should fall back to PIO.  If a DMA transfer
+   fails, DMA is turned off for D and false is returned.
+
+   The bus master moves the data while the CPU is free to run
+   other threads; the disk's completion interrupt wakes us up
+   through interrupt_handler() as for PIO commands. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              uint8_t *buffer, bool writing)
+{
+  struct channel *c = d->channel;
+  uint32_t phys;
+  size_t left;
+  uint8_t command, status, dev_status;
+  int i;
+
+  ASSERT (cnt > 0 && cnt <= MAX_MULTI_SECTORS);
+
+  /* Kernel virtual memory maps physical memory one-to-one, so a
+     kernel buffer is physically contiguous.  The bus master
+     needs an even address. */
+  if (!d->use_dma || !is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1))
+    return false;
+
+  /* Build the PRD table, splitting the buffer at 64 kB
+     boundaries. */
+  phys = vtop (buffer);
+  left = cnt * BLOCK_SECTOR_SIZE;
+  for (i = 0; left > 0; i++)
+    {
+      size_t size = 0x10000 - (phys & 0xffff);
+      if (size > left)
+        size = left;
+
+      ASSERT (i < PRD_CNT);
+      c->prdt[i].addr = phys;
+      c->prdt[i].size = size & 0xffff;
+      c->prdt[i].flags = 0;
+      phys += size;
+      left -= size;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+
+  /* Program the bus master, issue the command to the disk, then
+     start the bus master. */
+  command = writing ? 0 : BM_CMD_READ;
+  outl (bm_prdt (c), vtop (c->prdt));
+  outb (bm_command (c), command);
+  outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_IRQ);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, writing ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (bm_command (c), command | BM_CMD_START);
+
+  /* Wait for completion, stop the bus master, and check for
+     errors. */
+  sema_down (&c->completion_wait);
+  outb (bm_command (c), command);
+  status = inb (bm_status (c));
+  dev_status = inb (reg_alt_status (c));
+  outb (bm_status (c), status | BM_STA_ERR | BM_STA_IRQ);
+  if ((status & BM_STA_ERR) || (dev_status & STA_ERR))
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu"; falling back to PIO\n",
+              d->name, writing ? "write" : "read", sec_no);
+      d->use_dma = false;
+      return false;
+    }
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -7,8 +7,6 @@
 #include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
-#include "threads/palloc.h"
-#include "threads/malloc.h"
   
 /* See [8254] for hardware details of the 8254 timer chip. */
 
@@ -22,29 +20,69 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* If true, stop the periodic tick while idle.
+   Controlled by kernel command-line option "-tickless". */
+bool timer_tickless;
+
+/* PIT cycles per timer tick. */
+#define CYCLES_PER_TICK ((PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ)
+
+/* Most ticks that one PIT one-shot can cover.  The PIT counter
+   is only 16 bits wide, so a long idle period is covered by a
+   chain of one-shots rather than a single one. */
+#define MAX_ONESHOT_TICKS (65535 / CYCLES_PER_TICK)
+
+/* Number of ticks covered by the armed one-shot, or 0 if the
+   timer is in periodic mode, and the PIT count it was armed
+   with. */
+static int oneshot_ticks;
+static unsigned oneshot_count;
+
+/* PIT cycles of idle time, less than CYCLES_PER_TICK, that have
+   not yet been credited to TICKS.  A one-shot cut short by
+   another interrupt rarely ends on a tick boundary; the fraction
+   is kept here instead of being dropped, and the next one-shot
+   is shortened by it. */
+static unsigned idle_cycles;
+
+static void timer_resume_periodic (void);
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Timer ticks to calibrate the TSC against. */
+#define TSC_CALIBRATE_TICKS 10
+
+/* TSC cycles per second, or 0 until timer_calibrate() has
+   measured it.  timer_now_ns() returns TSC_BASE_NS plus the time
+   elapsed since the TSC read TSC_BASE. */
+static uint64_t tsc_hz;
+static uint64_t tsc_base;
+static int64_t tsc_base_ns;
+
+static inline uint64_t rdtsc (void);
+static int64_t tsc_to_ns (uint64_t cycles);
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
 
-/* ADD ALARM: new list of sleeping threads */
-static struct list sleep_list;
+/* ADD ALARM: sleeping threads, kept in a pairing heap ordered by
+   wakeup time.  The heap links are embedded in struct thread, so
+   sleeping allocates nothing.  Insertion is O(1) and removing the
+   earliest sleeper is O(log n) amortized. */
+static struct thread *sleep_heap;
 
-/* ADD ALARM: comparison func for sleeping threads */
-static bool sleep_thread_cmp(const struct list_elem *b1_,
-                             const struct list_elem *b2_, void *aux UNUSED)
-{
-  const struct sleeping_threads *b1 = list_entry (b1_, struct sleeping_threads, elem1);
-  const struct sleeping_threads *b2 = list_entry (b2_, struct sleeping_threads, elem1);
-  return b1->wakeup_time < b2->wakeup_time;
-}
-/* ADD ALARM: lock for accessing sleep_list */
-static struct lock sleep_list_lock;
+/* ADD ALARM: breaks ties between equal wakeup times, so that
+   threads due on the same tick wake in the order they slept. */
+static unsigned sleep_seq;
+
+static bool sleep_before (const struct thread *, const struct thread *);
+static struct thread *sleep_heap_meld (struct thread *, struct thread *);
+static struct thread *sleep_heap_merge_pairs (struct thread *);
 
 int constant1, constant2; //move computation outside timer_interrupt
 
@@ -56,8 +94,7 @@ timer_init (void)
   pit_configure_channel (0, 2, TIMER_FREQ);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 
-  list_init (&sleep_list);
-  lock_init (&sleep_list_lock);
+  sleep_heap = NULL;
 
   constant1 = divide_fixed_and_integer(convert_to_fixed_point(59),60);
   constant2 = divide_fixed_and_integer(convert_to_fixed_point(1),60);
@@ -68,6 +105,8 @@ void
 timer_calibrate (void) 
 {
   unsigned high_bit, test_bit;
+  uint64_t tsc_start;
+  int64_t start;
 
   ASSERT (intr_get_level () == INTR_ON);
   printf ("Calibrating timer...  ");
@@ -88,6 +127,20 @@ timer_calibrate (void)
       loops_per_tick |= test_bit;
 
   printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+
+  /* Count TSC cycles across TSC_CALIBRATE_TICKS whole ticks. */
+  start = ticks;
+  while (ticks == start)
+    barrier ();
+  tsc_start = rdtsc ();
+  start = ticks;
+  while (ticks - start < TSC_CALIBRATE_TICKS)
+    barrier ();
+
+  tsc_base_ns = start * (1000 * 1000 * 1000 / TIMER_FREQ);
+  tsc_base = tsc_start;
+  tsc_hz = (rdtsc () - tsc_start) * TIMER_FREQ / TSC_CALIBRATE_TICKS;
+  printf ("TSC runs at %'"PRIu64" Hz.\n", tsc_hz);
 }
 
 /* Returns the number of timer ticks since the OS booted. */
@@ -108,6 +161,17 @@ timer_elapsed (int64_t then)
   return timer_ticks () - then;
 }
 
+/* Returns the number of nanoseconds since the OS booted.  Once
+   timer_calibrate() has run, this has the resolution of the CPU's
+   time-stamp counter; before that, only of the timer tick. */
+int64_t
+timer_now_ns (void) 
+{
+  if (tsc_hz == 0)
+    return timer_ticks () * (1000 * 1000 * 1000 / TIMER_FREQ);
+  return tsc_base_ns + tsc_to_ns (rdtsc () - tsc_base);
+}
+
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
    be turned on. */
 void
@@ -120,23 +184,13 @@ timer_sleep (int64_t ticks)
     struct thread *cur = thread_current ();
     int64_t uptime = timer_ticks () + ticks;
 
-    //struct sleeping_threads *node = malloc(sizeof(struct sleeping_threads));
-    struct sleeping_threads *node = palloc_get_page (PAL_ZERO);
-    if (node == NULL)
-    PANIC ("Failed to allocate memory for a new blocked thread");
-
-    node->threadID = cur;
-    node->wakeup_time = uptime;
-
     /* MODIFY ALARM: thread_block() instead of thread_yield() */
-
-    //lock_acquire (&sleep_list_lock);    
-    //list_insert_ordered(&sleep_list,&(node->elem1),sleep_thread_cmp,NULL);
-    //lock_release (&sleep_list_lock);    
-
     enum intr_level old_level;
     old_level = intr_disable ();
-    list_insert_ordered(&sleep_list,&(node->elem1),sleep_thread_cmp,NULL);
+    cur->wakeup_time = uptime;
+    cur->sleep_seq = sleep_seq++;
+    cur->sleep_child = cur->sleep_sibling = NULL;
+    sleep_heap = sleep_heap_meld (sleep_heap, cur);
     thread_block();
     intr_set_level (old_level);
   }
@@ -205,6 +259,75 @@ timer_ndelay (int64_t ns)
   real_time_delay (ns, 1000 * 1000 * 1000);
 }
 
+/* Called by the idle thread, with interrupts off, just before
+   it halts the CPU.  In tickless mode, replaces the periodic tick
+   by a single PIT interrupt at the earliest sleeper's wakeup
+   time, so that an idle machine is not woken TIMER_FREQ times a
+   second for nothing. */
+void
+timer_idle_enter (void) 
+{
+  int64_t n = MAX_ONESHOT_TICKS;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!timer_tickless)
+    return;
+
+  /* Account for a one-shot cut short by another interrupt.  If
+     the one-shot's interrupt is already pending, it is still
+     armed, and that interrupt will wake us right away. */
+  timer_idle_exit ();
+  if (oneshot_ticks != 0)
+    return;
+
+  if (sleep_heap != NULL && sleep_heap->wakeup_time - ticks < n)
+    n = sleep_heap->wakeup_time - ticks;
+
+  /* The MLFQS load average and recent_cpu decay must be updated
+     exactly on each second boundary. */
+  if (thread_mlfqs && TIMER_FREQ - ticks % TIMER_FREQ < n)
+    n = TIMER_FREQ - ticks % TIMER_FREQ;
+
+  /* Not worth it for less than two ticks. */
+  if (n < 2)
+    return;
+
+  oneshot_ticks = n;
+  oneshot_count = n * CYCLES_PER_TICK - idle_cycles;
+  pit_configure_oneshot (0, oneshot_count);
+}
+
+/* Called with interrupts off when the idle thread is switched
+   out.  If a one-shot is armed and has not yet expired, credits
+   the time that has elapsed since it was armed and returns to
+   the periodic tick.  A one-shot that has expired is left for
+   timer_interrupt(), whose interrupt is pending, to account
+   for; crediting it here as well would count it twice. */
+void
+timer_idle_exit (void) 
+{
+  unsigned elapsed;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (oneshot_ticks == 0 || intr_pending (0x20))
+    return;
+
+  /* In mode 0 the counter keeps counting down after reaching
+     zero, wrapping around to 65535.  A reading above the initial
+     count therefore means that the one-shot expired just now,
+     after we checked for its interrupt. */
+  elapsed = oneshot_count - pit_read_counter (0);
+  if (elapsed >= oneshot_count || intr_pending (0x20))
+    return;
+
+  idle_cycles += elapsed;
+  ticks += idle_cycles / CYCLES_PER_TICK;
+  idle_cycles %= CYCLES_PER_TICK;
+  timer_resume_periodic ();
+}
+
 /* Prints timer statistics. */
 void
 timer_print_stats (void) 
@@ -217,24 +340,27 @@ int i,j;
 static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
+  /* In tickless mode, this interrupt may stand for several ticks
+     skipped while idle. */
+  if (oneshot_ticks != 0)
+    {
+      ticks += oneshot_ticks - 1;
+      idle_cycles = 0;
+      timer_resume_periodic ();
+    }
   ticks++;
 
   /* MODIFY ALARM: wake up sleeping threads */
-  struct sleeping_threads *node = list_entry(list_begin(&sleep_list),struct sleeping_threads,elem1);
-  while((node != NULL) && (ticks >= node->wakeup_time))
+  while(sleep_heap != NULL && ticks >= sleep_heap->wakeup_time)
   {
-    node = list_entry(list_pop_front(&sleep_list),struct sleeping_threads,elem1);
+    struct thread *t = sleep_heap;
+    sleep_heap = sleep_heap_merge_pairs (t->sleep_child);
 
-    thread_unblock (node->threadID);
+    thread_unblock (t);
 
     /* MODIFY PRIORITY: yield on return if higher priority thread is unblocked */
-    if(node->threadID->priority > thread_current()->priority)
+    if(t->priority > thread_current()->priority)
       intr_yield_on_return ();
-
-    palloc_free_page(node);
-    //free(node);
-
-    node = list_entry(list_begin(&sleep_list),struct sleeping_threads,elem1);
   }
 
   /* MODIFY MLFQS: timer interrupt handler */
@@ -242,7 +368,7 @@ timer_interrupt (struct intr_frame *args UNUSED)
   {
     //increment recent cpu at each tick
     if(thread_current() != get_idle_thread())
-      thread_current()->recent_cpu = add_fixed_and_integer(thread_current()->recent_cpu,1);
+      thread_mlfqs_charge_tick (thread_current());
 
     //update recent cpu and load avg every second
     if(ticks % TIMER_FREQ == 0)
@@ -251,13 +377,14 @@ timer_interrupt (struct intr_frame *args UNUSED)
        j = multiply_fixed_and_integer(constant2,get_ready_threads());
        set_system_load_avg(i + j);
 
-       thread_foreach (calculate_recent_cpu, 0);
+       thread_mlfqs_decay_recent_cpu ();
     }
 
-    //calculate priority every 4th tick
+    //calculate priority every 4th tick, only for threads whose
+    //recent_cpu changed since the last time
     if(ticks % 4 == 0)
     {
-      thread_foreach (calculate_priority, 0);
+      thread_mlfqs_update_priorities ();
       intr_yield_on_return ();
     }
   }
@@ -265,6 +392,82 @@ timer_interrupt (struct intr_frame *args UNUSED)
   thread_tick ();
 }
 
+/* Reprograms the PIT for the periodic tick after a one-shot. */
+static void
+timer_resume_periodic (void) 
+{
+  oneshot_ticks = 0;
+  pit_configure_channel (0, 2, TIMER_FREQ);
+}
+
+/* Returns true if sleeping thread A is due to wake before B. */
+static bool
+sleep_before (const struct thread *a, const struct thread *b)
+{
+  if (a->wakeup_time != b->wakeup_time)
+    return a->wakeup_time < b->wakeup_time;
+  return (int) (a->sleep_seq - b->sleep_seq) < 0;
+}
+
+/* Melds pairing heaps A and B, either of which may be empty, and
+   returns the root of the result. */
+static struct thread *
+sleep_heap_meld (struct thread *a, struct thread *b)
+{
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (sleep_before (b, a))
+    {
+      struct thread *tmp = a;
+      a = b;
+      b = tmp;
+    }
+  b->sleep_sibling = a->sleep_child;
+  a->sleep_child = b;
+  return a;
+}
+
+/* Combines the list of sibling heaps starting at FIRST into a
+   single heap, using the standard two-pass pairing strategy, and
+   returns its root.  Iterative, to keep the interrupt handler's
+   stack usage constant. */
+static struct thread *
+sleep_heap_merge_pairs (struct thread *first)
+{
+  struct thread *pairs = NULL;
+  struct thread *result = NULL;
+
+  /* First pass: meld siblings in pairs from left to right,
+     collecting the results in reverse order. */
+  while (first != NULL)
+    {
+      struct thread *a = first;
+      struct thread *b = a->sleep_sibling;
+      struct thread *pair;
+
+      first = b != NULL ? b->sleep_sibling : NULL;
+      a->sleep_sibling = NULL;
+      if (b != NULL)
+        b->sleep_sibling = NULL;
+
+      pair = sleep_heap_meld (a, b);
+      pair->sleep_sibling = pairs;
+      pairs = pair;
+    }
+
+  /* Second pass: meld the pairs from right to left. */
+  while (pairs != NULL)
+    {
+      struct thread *next = pairs->sleep_sibling;
+      pairs->sleep_sibling = NULL;
+      result = sleep_heap_meld (result, pairs);
+      pairs = next;
+    }
+  return result;
+}
+
 /* Returns true if LOOPS iterations waits for more than one timer
    tick, otherwise false. */
 static bool
@@ -309,6 +512,7 @@ real_time_sleep (int64_t num, int32_t denom)
      1 s / TIMER_FREQ ticks
   */
   int64_t ticks = num * TIMER_FREQ / denom;
+  int64_t deadline = timer_now_ns () + num * (1000 * 1000 * 1000 / denom);
 
   ASSERT (intr_get_level () == INTR_ON);
   if (ticks > 0)
@@ -318,7 +522,14 @@ real_time_sleep (int64_t num, int32_t denom)
          processes. */                
       timer_sleep (ticks); 
     }
-  else 
+
+  if (tsc_hz != 0)
+    {
+      /* Busy-wait for whatever part of a tick is left. */
+      while (timer_now_ns () < deadline)
+        barrier ();
+    }
+  else if (ticks <= 0)
     {
       /* Otherwise, use a busy-wait loop for more accurate
          sub-tick timing. */
@@ -330,8 +541,37 @@ real_time_sleep (int64_t num, int32_t denom)
 static void
 real_time_delay (int64_t num, int32_t denom)
 {
+  if (tsc_hz != 0)
+    {
+      /* Spin on the TSC, which stays exact however much time
+         interrupt handlers steal from the loop. */
+      int64_t deadline = timer_now_ns () + num * (1000 * 1000 * 1000 / denom);
+      while (timer_now_ns () < deadline)
+        barrier ();
+      return;
+    }
+
   /* Scale the numerator and denominator down by 1000 to avoid
      the possibility of overflow. */
   ASSERT (denom % 1000 == 0);
   busy_wait (loops_per_tick * num / 1000 * TIMER_FREQ / (denom / 1000)); 
 }
+
+/* Reads the CPU's time-stamp counter.  See [IA32-v2b] "RDTSC". */
+static inline uint64_t
+rdtsc (void) 
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Converts CYCLES of the TSC into nanoseconds, splitting the
+   division so that the intermediate product cannot overflow. */
+static int64_t
+tsc_to_ns (uint64_t cycles) 
+{
+  uint64_t sec = cycles / tsc_hz;
+  uint64_t rem = cycles % tsc_hz;
+  return sec * 1000 * 1000 * 1000 + rem * 1000 * 1000 * 1000 / tsc_hz;
+}
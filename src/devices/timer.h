@@ -2,21 +2,15 @@
 #define DEVICES_TIMER_H
 
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
-#include <list.h>
 
 /* Number of timer interrupts per second. */
 #define TIMER_FREQ 100
 
-/* ADD ALARM: structure declaration for the sleep_list */
-struct sleeping_threads
-{
-  struct thread *threadID;
-  uint64_t wakeup_time;
-  struct list_elem elem1;
-};
-
-
+/* If true, stop the periodic tick while idle.
+   Controlled by kernel command-line option "-tickless". */
+extern bool timer_tickless;
 
 void timer_init (void);
 void timer_calibrate (void);
@@ -24,6 +18,9 @@ void timer_calibrate (void);
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
 
+/* High-resolution monotonic clock. */
+int64_t timer_now_ns (void);
+
 /* Sleep and yield the CPU to other threads. */
 void timer_sleep (int64_t ticks);
 void timer_msleep (int64_t milliseconds);
@@ -35,6 +32,10 @@ void timer_mdelay (int64_t milliseconds);
 void timer_udelay (int64_t microseconds);
 void timer_ndelay (int64_t nanoseconds);
 
+/* Tickless idle. */
+void timer_idle_enter (void);
+void timer_idle_exit (void);
+
 void timer_print_stats (void);
 
 #endif /* devices/timer.h */
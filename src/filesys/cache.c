@@ -0,0 +1,617 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Buffer cache of file system sectors.
+
+   Every sector of fs_device that the file system reads or writes
+   goes through this cache.  Writes only dirty the cached copy;
+   dirty sectors reach the disk when they are evicted, when the
+   write-behind thread runs, or when the file system shuts down.
+
+   A single lock protects all cache entries.  It is held while
+   copying data in and out of an entry but never across disk I/O:
+   an entry whose sector is being read or written is marked busy,
+   and anyone who wants it waits on io_done.
+
+   Metadata sectors written by cache_write_meta() belong to the
+   running journal transaction.  They are pinned: they are
+   neither evicted nor written back until the journal commits
+   the transaction and calls cache_unpin().  See journal.c.
+
+   Large, sector-aligned file data transfers can bypass the cache
+   with cache_read_direct() and cache_write_direct(), which move
+   whole runs of sectors straight between the disk and the
+   caller's buffer.  They stay coherent with cached copies: a
+   direct read takes any sector that is cached from the cache and
+   keeps dirty cached copies of its sectors from being written
+   back or evicted until it is done, and a direct write updates
+   cached copies and keeps the cache from loading the sectors
+   until the write reaches the disk. */
+
+/* Number of sectors in the cache. */
+#define CACHE_SIZE 64
+
+/* Timer ticks between runs of the write-behind thread. */
+#define WRITE_BEHIND_TICKS (5 * TIMER_FREQ)
+
+/* Maximum number of pending read-ahead requests. */
+#define READAHEAD_MAX 16
+
+/* A cached sector. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Sector number, if valid. */
+    bool valid;                         /* Holds a sector? */
+    bool dirty;                         /* Modified since read or written? */
+    bool accessed;                      /* Used since the clock hand passed? */
+    bool busy;                          /* Disk I/O in progress? */
+    bool pinned;                        /* Held for the journal? */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;          /* Protects everything above. */
+static struct condition io_done;        /* Signaled when I/O finishes. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* A run of sectors that cache_read_direct() is reading or
+   cache_write_direct() is writing.  On direct_reads or
+   direct_writes, protected by cache_lock. */
+struct direct_run
+  {
+    struct list_elem elem;              /* List element. */
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+static struct list direct_reads;
+static struct list direct_writes;
+
+/* Read-ahead requests, a ring buffer protected by cache_lock. */
+static block_sector_t readahead_queue[READAHEAD_MAX];
+static size_t readahead_head, readahead_cnt;
+static struct semaphore readahead_sema; /* Counts queued requests. */
+
+static struct cache_entry *cache_get (block_sector_t, bool load);
+static struct cache_entry *cache_find (block_sector_t);
+static struct cache_entry *cache_victim (void);
+static bool reading_directly (block_sector_t);
+static void cache_write_back (struct cache_entry *);
+static thread_func write_behind NO_RETURN;
+static thread_func read_ahead NO_RETURN;
+
+/* Initializes the buffer cache and starts its helper threads. */
+void
+cache_init (void) 
+{
+  lock_init (&cache_lock);
+  lock_stats_register (&cache_lock.stats, "cache");
+  cond_init (&io_done);
+  list_init (&direct_reads);
+  list_init (&direct_writes);
+  sema_init (&readahead_sema, 0);
+  thread_create ("cache-flush", PRI_DEFAULT, write_behind, NULL);
+  thread_create ("cache-ahead", PRI_DEFAULT, read_ahead, NULL);
+}
+
+/* Writes every dirty sector to disk, at file system shutdown. */
+void
+cache_done (void) 
+{
+  cache_flush ();
+}
+
+/* Writes every dirty sector in the cache to disk. */
+void
+cache_flush (void) 
+{
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      while (e->busy
+             || (e->valid && e->dirty && reading_directly (e->sector)))
+        cond_wait (&io_done, &cache_lock);
+      if (e->valid && e->dirty && !e->pinned)
+        cache_write_back (e);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Reads SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer) 
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within SECTOR into
+   BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, size_t ofs, size_t size) 
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  lock_acquire (&cache_lock);
+  e = cache_get (sector, true);
+  memcpy (buffer, e->data + ofs, size);
+  lock_release (&cache_lock);
+}
+
+/* Returns true if SECTOR is in one of the struct direct_runs on
+   LIST. */
+static bool
+in_direct_run (struct list *list, block_sector_t sector) 
+{
+  struct list_elem *e;
+
+  for (e = list_begin (list); e != list_end (list); e = list_next (e))
+    {
+      struct direct_run *r = list_entry (e, struct direct_run, elem);
+      if (sector >= r->start && sector - r->start < r->cnt)
+        return true;
+    }
+  return false;
+}
+
+/* Returns true if SECTOR is being read by cache_read_direct(). */
+static bool
+reading_directly (block_sector_t sector) 
+{
+  return in_direct_run (&direct_reads, sector);
+}
+
+/* Returns true if SECTOR is being written by
+   cache_write_direct(). */
+static bool
+writing_directly (block_sector_t sector) 
+{
+  return in_direct_run (&direct_writes, sector);
+}
+
+/* Waits until none of the CNT sectors starting at SECTOR has
+   disk I/O in progress through the cache.  The caller must hold
+   cache_lock. */
+static void
+wait_for_run (block_sector_t sector, size_t cnt) 
+{
+  size_t i = 0;
+
+  while (i < cnt)
+    {
+      struct cache_entry *e = cache_find (sector + i);
+      if (e != NULL && e->busy)
+        {
+          cond_wait (&io_done, &cache_lock);
+          i = 0;
+        }
+      else
+        i++;
+    }
+}
+
+/* Reads the CNT sectors starting at SECTOR into BUFFER, which
+   must have room for CNT * BLOCK_SECTOR_SIZE bytes, directly
+   from the disk without bringing them into the cache.  Sectors
+   that are already cached are copied from the cache, which may
+   be newer than the disk.  Until the read is done, dirty cached
+   copies stay in the cache and are not written back, so that a
+   write-back cannot reach the disk after the read and leave the
+   cache without the newer copy. */
+void
+cache_read_direct (block_sector_t sector, size_t cnt, void *buffer_) 
+{
+  uint8_t *buffer = buffer_;
+  struct direct_run r;
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  wait_for_run (sector, cnt);
+  r.start = sector;
+  r.cnt = cnt;
+  list_push_back (&direct_reads, &r.elem);
+  lock_release (&cache_lock);
+
+  block_read_multi (fs_device, sector, cnt, buffer);
+
+  lock_acquire (&cache_lock);
+  list_remove (&r.elem);
+  for (i = 0; i < cnt; i++)
+    {
+      struct cache_entry *e = cache_find (sector + i);
+      if (e != NULL && !e->busy)
+        memcpy (buffer + i * BLOCK_SECTOR_SIZE, e->data, BLOCK_SECTOR_SIZE);
+    }
+  cond_broadcast (&io_done, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Writes the CNT sectors starting at SECTOR from BUFFER, which
+   must contain CNT * BLOCK_SECTOR_SIZE bytes, directly to the
+   disk.  Cached copies of the sectors are updated and marked
+   clean, and sectors that are not cached are not loaded into
+   the cache until the write is done.  Must not be used for
+   metadata, which is journaled. */
+void
+cache_write_direct (block_sector_t sector, size_t cnt, const void *buffer_) 
+{
+  const uint8_t *buffer = buffer_;
+  struct direct_run w;
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  wait_for_run (sector, cnt);
+  for (i = 0; i < cnt; i++)
+    {
+      struct cache_entry *e = cache_find (sector + i);
+      if (e != NULL)
+        {
+          ASSERT (!e->pinned);
+          memcpy (e->data, buffer + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+          e->dirty = false;
+        }
+    }
+  w.start = sector;
+  w.cnt = cnt;
+  list_push_back (&direct_writes, &w.elem);
+  lock_release (&cache_lock);
+
+  block_write_multi (fs_device, sector, cnt, buffer);
+
+  lock_acquire (&cache_lock);
+  list_remove (&w.elem);
+  cond_broadcast (&io_done, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER to SECTOR. */
+void
+cache_write (block_sector_t sector, const void *buffer) 
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR, starting at byte
+   offset OFS within the sector.  The rest of the sector is read
+   from disk first unless the write covers all of it. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                size_t ofs, size_t size) 
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  lock_acquire (&cache_lock);
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  lock_release (&cache_lock);
+}
+
+/* Writes metadata: like cache_write_at(), but adds SECTOR to
+   the running journal transaction and pins it in the cache until
+   that transaction commits.  The running thread must be inside a
+   journal handle. */
+void
+cache_write_meta_at (block_sector_t sector, const void *buffer,
+                     size_t ofs, size_t size) 
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  lock_acquire (&cache_lock);
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  e->pinned = true;
+  lock_release (&cache_lock);
+
+  journal_add (sector);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes of metadata from BUFFER to
+   SECTOR, as with cache_write_meta_at(). */
+void
+cache_write_meta (block_sector_t sector, const void *buffer) 
+{
+  cache_write_meta_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Releases SECTOR, which the journal has committed, and writes
+   it to its home location if it is dirty.  Called only by the
+   journal. */
+void
+cache_unpin (block_sector_t sector) 
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  e = cache_find (sector);
+  if (e != NULL)
+    {
+      while (e->busy)
+        cond_wait (&io_done, &cache_lock);
+      e->pinned = false;
+      if (e->dirty)
+        cache_write_back (e);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Asks for SECTOR to be read into the cache in the background,
+   in anticipation of a read in the near future.  The request is
+   dropped if SECTOR is already cached or too many requests are
+   pending. */
+void
+cache_readahead (block_sector_t sector) 
+{
+  bool queued = false;
+
+  lock_acquire (&cache_lock);
+  if (readahead_cnt < READAHEAD_MAX && cache_find (sector) == NULL)
+    {
+      readahead_queue[(readahead_head + readahead_cnt++) % READAHEAD_MAX]
+        = sector;
+      queued = true;
+    }
+  lock_release (&cache_lock);
+
+  if (queued)
+    sema_up (&readahead_sema);
+}
+
+/* A sector that cache_prefetch() is reading. */
+struct prefetch
+  {
+    struct block_request r;             /* Disk request. */
+    struct cache_entry *e;              /* Entry being filled. */
+  };
+
+/* Completion function for cache_prefetch()'s requests. */
+static void
+prefetch_done (struct block_request *r) 
+{
+  sema_up (r->aux);
+}
+
+/* Brings the CNT sectors in SECTORS, which should be in
+   ascending order, into the cache, at most CACHE_PREFETCH_MAX of
+   them.  Unlike cache_readahead(), reads all of the sectors that
+   are not yet cached in one batch of disk requests and waits for
+   them, so that the block layer can merge runs of consecutive
+   sectors into single transfers.  Sectors numbered 0, which stand
+   for unallocated blocks, and sectors past the end of the disk
+   are skipped. */
+void
+cache_prefetch (const block_sector_t *sectors, size_t cnt) 
+{
+  struct prefetch *p;
+  struct semaphore done;
+  size_t n, i;
+
+  if (cnt > CACHE_PREFETCH_MAX)
+    cnt = CACHE_PREFETCH_MAX;
+  p = malloc (cnt * sizeof *p);
+  if (p == NULL)
+    return;
+  sema_init (&done, 0);
+
+  /* Claim an entry for each sector that is not cached, marking it
+     busy so that readers wait for the data. */
+  lock_acquire (&cache_lock);
+  n = 0;
+  for (i = 0; i < cnt; i++) 
+    {
+      block_sector_t sector = sectors[i];
+      struct cache_entry *e;
+
+      if (sector == 0 || sector >= block_size (fs_device)
+          || cache_find (sector) != NULL || writing_directly (sector))
+        continue;
+
+      e = cache_victim ();
+      if (e == NULL)
+        break;
+      if (e->valid && e->dirty)
+        {
+          /* This releases cache_lock, so look at SECTOR again. */
+          cache_write_back (e);
+          i--;
+          continue;
+        }
+
+      e->sector = sector;
+      e->valid = true;
+      e->dirty = false;
+      e->accessed = true;
+      e->busy = true;
+      p[n].e = e;
+      p[n].r.sector = sector;
+      p[n].r.cnt = 1;
+      p[n].r.buffer = e->data;
+      p[n].r.write = false;
+      p[n].r.complete = prefetch_done;
+      p[n].r.aux = &done;
+      n++;
+    }
+  lock_release (&cache_lock);
+
+  for (i = 0; i < n; i++)
+    block_submit (fs_device, &p[i].r);
+  for (i = 0; i < n; i++)
+    sema_down (&done);
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < n; i++)
+    p[i].e->busy = false;
+  cond_broadcast (&io_done, &cache_lock);
+  lock_release (&cache_lock);
+  free (p);
+}
+
+/* Returns the entry that holds SECTOR, or a null pointer if
+   SECTOR is not cached.  The caller must hold cache_lock. */
+static struct cache_entry *
+cache_find (block_sector_t sector) 
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Returns the entry for SECTOR, bringing it into the cache if
+   necessary.  If LOAD is false, a newly cached sector is not read
+   from disk, because the caller is about to overwrite all of it.
+   The caller must hold cache_lock, which may be released and
+   reacquired while waiting for disk I/O; the returned entry is
+   not busy. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load) 
+{
+  for (;;) 
+    {
+      struct cache_entry *e = cache_find (sector);
+
+      if (e != NULL)
+        {
+          if (e->busy)
+            {
+              cond_wait (&io_done, &cache_lock);
+              continue;
+            }
+          e->accessed = true;
+          return e;
+        }
+
+      /* Don't load a sector from the disk while a direct write
+         to it is in progress. */
+      if (load && writing_directly (sector))
+        {
+          cond_wait (&io_done, &cache_lock);
+          continue;
+        }
+
+      /* Every entry may be busy, pinned or being read past.  The
+         journal pins at most JOURNAL_BLOCKS entries, so some must
+         be busy or read past, and will soon be done. */
+      e = cache_victim ();
+      if (e == NULL)
+        {
+          cond_wait (&io_done, &cache_lock);
+          continue;
+        }
+
+      /* Write back the victim.  Someone may have brought in
+         SECTOR or touched the victim meanwhile, so start over. */
+      if (e->valid && e->dirty)
+        {
+          cache_write_back (e);
+          continue;
+        }
+
+      e->sector = sector;
+      e->valid = true;
+      e->dirty = false;
+      e->accessed = true;
+      if (load)
+        {
+          e->busy = true;
+          lock_release (&cache_lock);
+          block_read (fs_device, sector, e->data);
+          lock_acquire (&cache_lock);
+          e->busy = false;
+          cond_broadcast (&io_done, &cache_lock);
+        }
+      return e;
+    }
+}
+
+/* Runs the clock hand until it finds an entry that is idle and
+   has not been used since the last pass, and returns it.  Dirty
+   entries that cache_read_direct() is reading past are not
+   idle.  Two full passes clear every accessed bit, so if none is
+   found by then, every entry is busy, pinned or being read past
+   and a null pointer is returned.  The caller must hold
+   cache_lock. */
+static struct cache_entry *
+cache_victim (void) 
+{
+  size_t i;
+
+  for (i = 0; i < 2 * CACHE_SIZE; i++) 
+    {
+      struct cache_entry *c = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+      if (c->busy || c->pinned
+          || (c->valid && c->dirty && reading_directly (c->sector)))
+        continue;
+      if (c->valid && c->accessed)
+        c->accessed = false;
+      else
+        return c;
+    }
+  return NULL;
+}
+
+/* Writes dirty entry E to disk.  The caller must hold cache_lock,
+   which is released during the write. */
+static void
+cache_write_back (struct cache_entry *e) 
+{
+  ASSERT (e->valid && e->dirty && !e->busy && !e->pinned);
+
+  e->busy = true;
+  e->dirty = false;
+  lock_release (&cache_lock);
+  block_write (fs_device, e->sector, e->data);
+  lock_acquire (&cache_lock);
+  e->busy = false;
+  cond_broadcast (&io_done, &cache_lock);
+}
+
+/* Write-behind thread: periodically writes dirty sectors to
+   disk, so that a crash loses only recent writes. */
+static void
+write_behind (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      timer_sleep (WRITE_BEHIND_TICKS);
+      cache_flush ();
+    }
+}
+
+/* Read-ahead thread: brings requested sectors into the cache. */
+static void
+read_ahead (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      block_sector_t sector;
+
+      sema_down (&readahead_sema);
+      lock_acquire (&cache_lock);
+      sector = readahead_queue[readahead_head];
+      readahead_head = (readahead_head + 1) % READAHEAD_MAX;
+      readahead_cnt--;
+      cache_get (sector, true);
+      lock_release (&cache_lock);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+void cache_init (void);
+void cache_done (void);
+void cache_flush (void);
+
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_write_meta (block_sector_t, const void *);
+void cache_write_meta_at (block_sector_t, const void *,
+                          size_t ofs, size_t size);
+void cache_unpin (block_sector_t);
+void cache_readahead (block_sector_t);
+
+/* Most sectors that cache_prefetch() reads at once. */
+#define CACHE_PREFETCH_MAX 32
+
+void cache_prefetch (const block_sector_t *, size_t cnt);
+void cache_read_direct (block_sector_t, size_t cnt, void *);
+void cache_write_direct (block_sector_t, size_t cnt, const void *);
+
+#endif /* filesys/cache.h */
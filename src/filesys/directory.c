@@ -1,10 +1,13 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 /* A directory. */
 struct dir 
@@ -21,12 +24,101 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* In-memory index of the entries in a directory, so that lookups
+   need not read the whole directory.  It is attached to the
+   directory's inode, so every struct dir open on that inode
+   shares it.  It is built on the first lookup, which holds the
+   inode lock shared, and kept up to date by dir_add() and
+   dir_remove(), which hold it exclusively. */
+struct dir_index
+  {
+    struct hash entries;                /* Index entries, by name. */
+    off_t free_ofs;                     /* No free slot before here. */
+  };
+
+/* An in-use directory entry in a dir_index. */
+struct dir_index_entry
+  {
+    struct hash_elem elem;              /* Element in dir_index entries. */
+    off_t ofs;                          /* Offset of entry in directory. */
+    block_sector_t inode_sector;        /* Sector number of header. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+  };
+
+/* Serializes building indexes, since that happens while the
+   inode lock is only held shared. */
+static struct lock dir_index_lock;
+
+/* Dentry cache.
+
+   Maps a (directory sector, name) pair to the sector of the
+   inode that the name refers to, so that resolving a path does
+   not have to read each intermediate directory.  Only positive
+   results are cached.  Entries are looked up and added while
+   holding the directory's inode lock at least shared and are
+   invalidated by dir_remove() while holding it exclusively, so
+   a hit is always current.  The cache holds at most DCACHE_CNT
+   entries; the least recently used is recycled when it is
+   full. */
+#define DCACHE_CNT 128
+
+/* A dentry cache entry. */
+struct dentry
+  {
+    struct hash_elem elem;              /* Element in dcache. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+    block_sector_t dir_sector;          /* Directory inode sector. */
+    block_sector_t inode_sector;        /* Sector that NAME refers to. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+  };
+
+static struct dentry dentries[DCACHE_CNT];
+static struct hash dcache;              /* Dentries in use. */
+static struct list dcache_lru;          /* All dentries, most recent first. */
+static struct lock dcache_lock;         /* Protects the above. */
+
+static unsigned dentry_hash (const struct hash_elem *, void *);
+static bool dentry_less (const struct hash_elem *, const struct hash_elem *,
+                         void *);
+
+/* Initializes the directory module. */
+void
+dir_init (void) 
+{
+  size_t i;
+
+  lock_init (&dir_index_lock);
+  lock_init (&dcache_lock);
+  lock_stats_register (&dcache_lock.stats, "dcache");
+  if (!hash_init (&dcache, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry cache creation failed");
+  list_init (&dcache_lru);
+  for (i = 0; i < DCACHE_CNT; i++)
+    {
+      dentries[i].dir_sector = 0;
+      list_push_back (&dcache_lru, &dentries[i].lru_elem);
+    }
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR, with "." and ".." entries that refer to itself
+   and to the directory in PARENT_SECTOR, respectively.  Returns
+   true if successful, false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, block_sector_t parent_sector,
+            size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir *dir;
+  bool success;
+
+  if (!inode_create (sector, entry_cnt * sizeof (struct dir_entry), true))
+    return false;
+  dir = dir_open (inode_open (sector));
+  success = (dir != NULL
+             && dir_add (dir, ".", sector)
+             && dir_add (dir, "..", parent_sector));
+  dir_close (dir);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -57,6 +149,16 @@ dir_open_root (void)
   return dir_open (inode_open (ROOT_DIR_SECTOR));
 }
 
+/* Opens the running thread's current working directory, or the
+   root directory if it has none, and returns a directory for
+   it.  Returns a null pointer on failure. */
+struct dir *
+dir_open_cwd (void) 
+{
+  struct dir *cwd = thread_current ()->cwd;
+  return cwd != NULL ? dir_reopen (cwd) : dir_open_root ();
+}
+
 /* Opens and returns a new directory for the same inode as DIR.
    Returns a null pointer on failure. */
 struct dir *
@@ -83,21 +185,278 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Returns true if NAME is "." or "..". */
+static bool
+is_dot_name (const char *name) 
+{
+  return !strcmp (name, ".") || !strcmp (name, "..");
+}
+
+/* Returns the hash value of dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  const struct dentry *d = hash_entry (e, struct dentry, elem);
+  return hash_string (d->name) ^ hash_int (d->dir_sector);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED) 
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, elem);
+  if (a->dir_sector != b->dir_sector)
+    return a->dir_sector < b->dir_sector;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the dentry for NAME in the directory at DIR_SECTOR, or
+   a null pointer if none is cached.  The caller must hold
+   dcache_lock. */
+static struct dentry *
+dcache_find (block_sector_t dir_sector, const char *name) 
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir_sector = dir_sector;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache, &key.elem);
+  return e != NULL ? hash_entry (e, struct dentry, elem) : NULL;
+}
+
+/* Looks up NAME in the directory at DIR_SECTOR in the dentry
+   cache.  On a hit, stores the sector it refers to in
+   *INODE_SECTOR and returns true; otherwise returns false. */
+static bool
+dcache_lookup (block_sector_t dir_sector, const char *name,
+               block_sector_t *inode_sector) 
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (dir_sector, name);
+  if (d != NULL)
+    {
+      *inode_sector = d->inode_sector;
+      list_remove (&d->lru_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory at DIR_SECTOR refers to
+   INODE_SECTOR, recycling the least recently used dentry. */
+static void
+dcache_insert (block_sector_t dir_sector, const char *name,
+               block_sector_t inode_sector) 
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  if (dcache_find (dir_sector, name) == NULL)
+    {
+      d = list_entry (list_back (&dcache_lru), struct dentry, lru_elem);
+      if (d->dir_sector != 0)
+        hash_delete (&dcache, &d->elem);
+      d->dir_sector = dir_sector;
+      d->inode_sector = inode_sector;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache, &d->elem);
+      list_remove (&d->lru_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Drops any dentry for NAME in the directory at DIR_SECTOR. */
+static void
+dcache_invalidate (block_sector_t dir_sector, const char *name) 
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (dir_sector, name);
+  if (d != NULL)
+    {
+      hash_delete (&dcache, &d->elem);
+      d->dir_sector = 0;
+      list_remove (&d->lru_elem);
+      list_push_back (&dcache_lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the hash value of dir_index_entry E. */
+static unsigned
+index_entry_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  return hash_string (hash_entry (e, struct dir_index_entry, elem)->name);
+}
+
+/* Returns true if dir_index_entry A's name precedes B's. */
+static bool
+index_entry_less (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED) 
+{
+  return strcmp (hash_entry (a, struct dir_index_entry, elem)->name,
+                 hash_entry (b, struct dir_index_entry, elem)->name) < 0;
+}
+
+/* Frees dir_index_entry E.  Used as a hash_action_func. */
+static void
+index_entry_destroy (struct hash_elem *e, void *aux UNUSED) 
+{
+  free (hash_entry (e, struct dir_index_entry, elem));
+}
+
+/* Destroys INDEX, which may be a null pointer. */
+void
+dir_index_destroy (struct dir_index *index) 
+{
+  if (index != NULL)
+    {
+      hash_destroy (&index->entries, index_entry_destroy);
+      free (index);
+    }
+}
+
+/* Adds directory entry E, found at offset OFS, to INDEX.
+   Returns true if successful, false if out of memory. */
+static bool
+index_insert (struct dir_index *index, const struct dir_entry *e,
+              off_t ofs) 
+{
+  struct dir_index_entry *ie = malloc (sizeof *ie);
+  if (ie == NULL)
+    return false;
+  ie->ofs = ofs;
+  ie->inode_sector = e->inode_sector;
+  strlcpy (ie->name, e->name, sizeof ie->name);
+  hash_insert (&index->entries, &ie->elem);
+  return true;
+}
+
+/* Returns INDEX's entry for NAME, or a null pointer if there is
+   none. */
+static struct dir_index_entry *
+index_find (struct dir_index *index, const char *name) 
+{
+  struct dir_index_entry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&index->entries, &key.elem);
+  return e != NULL ? hash_entry (e, struct dir_index_entry, elem) : NULL;
+}
+
+/* Reads the directory in INODE and returns a new index for it,
+   or a null pointer if memory is short. */
+static struct dir_index *
+index_build (struct inode *inode) 
+{
+  struct dir_index *index;
+  struct dir_entry e;
+  off_t ofs;
+
+  index = malloc (sizeof *index);
+  if (index == NULL)
+    return NULL;
+  if (!hash_init (&index->entries, index_entry_hash, index_entry_less, NULL))
+    {
+      free (index);
+      return NULL;
+    }
+
+  index->free_ofs = -1;
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e) 
+    if (!e.in_use)
+      {
+        if (index->free_ofs < 0)
+          index->free_ofs = ofs;
+      }
+    else if (!index_insert (index, &e, ofs))
+      {
+        dir_index_destroy (index);
+        return NULL;
+      }
+  if (index->free_ofs < 0)
+    index->free_ofs = ofs;
+  return index;
+}
+
+/* Returns the index for DIR, building it if necessary, or a null
+   pointer if it cannot be built.  The caller must hold DIR's
+   inode lock. */
+static struct dir_index *
+get_index (const struct dir *dir) 
+{
+  struct dir_index *index;
+
+  lock_acquire (&dir_index_lock);
+  index = inode_get_dir_index (dir->inode);
+  if (index == NULL)
+    {
+      index = index_build (dir->inode);
+      inode_set_dir_index (dir->inode, index);
+    }
+  lock_release (&dir_index_lock);
+  return index;
+}
+
+/* Discards DIR's index after a change that it could not record.
+   The next lookup will rebuild it.  The caller must hold DIR's
+   inode lock exclusively. */
+static void
+drop_index (struct dir *dir) 
+{
+  dir_index_destroy (inode_get_dir_index (dir->inode));
+  inode_set_dir_index (dir->inode, NULL);
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   The caller must hold DIR's inode lock. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
+  struct dir_index *index;
   struct dir_entry e;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  index = get_index (dir);
+  if (index != NULL)
+    {
+      struct dir_index_entry *ie = index_find (index, name);
+      if (ie == NULL)
+        return false;
+      if (ep != NULL)
+        {
+          ep->inode_sector = ie->inode_sector;
+          strlcpy (ep->name, ie->name, sizeof ep->name);
+          ep->in_use = true;
+        }
+      if (ofsp != NULL)
+        *ofsp = ie->ofs;
+      return true;
+    }
+
+  /* No memory for an index: fall back to a linear search. */
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
@@ -119,15 +478,25 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector;
+  block_sector_t inode_sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  dir_sector = inode_get_inumber (dir->inode);
+  inode_lock_shared (dir->inode);
+  if (dcache_lookup (dir_sector, name, &inode_sector))
+    *inode = inode_open (inode_sector);
+  else if (lookup (dir, name, &e, NULL))
+    {
+      dcache_insert (dir_sector, name, e.inode_sector);
+      *inode = inode_open (e.inode_sector);
+    }
   else
     *inode = NULL;
+  inode_unlock_shared (dir->inode);
 
   return *inode != NULL;
 }
@@ -136,11 +505,12 @@ dir_lookup (const struct dir *dir, const char *name,
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
    Returns true if successful, false on failure.
-   Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   Fails if NAME is invalid (i.e. too long), if DIR has been
+   removed, or if a disk or memory error occurs. */
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_index *index;
   struct dir_entry e;
   off_t ofs;
   bool success = false;
@@ -152,18 +522,23 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  inode_lock_exclusive (dir->inode);
+
+  /* Check that DIR still exists and that NAME is not in use. */
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL))
     goto done;
 
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
+     current end-of-file.  The index, if any, tells us where to
+     start looking.
      
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  index = inode_get_dir_index (dir->inode);
+  for (ofs = index != NULL ? index->free_ofs : 0;
+       inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (!e.in_use)
       break;
@@ -174,16 +549,44 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
+  /* Update index. */
+  if (index != NULL)
+    {
+      if (success && index_insert (index, &e, ofs))
+        index->free_ofs = ofs + sizeof e;
+      else
+        drop_index (dir);
+    }
+
  done:
+  inode_unlock_exclusive (dir->inode);
   return success;
 }
 
+/* Returns true if DIR contains no entries other than "." and
+   "..".  The caller must hold DIR's inode lock. */
+static bool
+is_empty (struct dir *dir) 
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e) 
+    if (e.in_use && !is_dot_name (e.name))
+      return false;
+  return true;
+}
+
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs if there is no file with the given NAME, if NAME
+   is "." or "..", or if NAME is a directory that is not
+   empty. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  struct dir_index *index;
   struct dir_entry e;
   struct inode *inode = NULL;
   bool success = false;
@@ -192,6 +595,11 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (is_dot_name (name))
+    return false;
+
+  inode_lock_exclusive (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -201,36 +609,84 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* Only empty directories may be removed.  Taking the child's
+     lock while holding the parent's follows the same order as
+     path resolution. */
+  if (inode_is_dir (inode))
+    {
+      struct dir child;
+      bool empty;
+
+      child.inode = inode;
+      child.pos = 0;
+      inode_lock_shared (inode);
+      empty = is_empty (&child);
+      inode_unlock_shared (inode);
+      if (!empty)
+        goto done;
+      dcache_invalidate (e.inode_sector, ".");
+      dcache_invalidate (e.inode_sector, "..");
+    }
+
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
+  /* Update index and dentry cache. */
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+  index = inode_get_dir_index (dir->inode);
+  if (index != NULL)
+    {
+      struct dir_index_entry *ie = index_find (index, name);
+      hash_delete (&index->entries, &ie->elem);
+      free (ie);
+      if (ofs < index->free_ofs)
+        index->free_ofs = ofs;
+    }
+
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  inode_unlock_exclusive (dir->inode);
   inode_close (inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  The "." and ".." entries are
+   skipped. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
+{
+  block_sector_t inode_sector;
+  return dir_readdir_sector (dir, name, &inode_sector);
+}
+
+/* Like dir_readdir(), but also stores the sector of the entry's
+   inode in *INODE_SECTOR. */
+bool
+dir_readdir_sector (struct dir *dir, char name[NAME_MAX + 1],
+                    block_sector_t *inode_sector)
 {
   struct dir_entry e;
+  bool found = false;
 
+  inode_lock_shared (dir->inode);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
-      if (e.in_use)
+      if (e.in_use && !is_dot_name (e.name))
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          *inode_sector = e.inode_sector;
+          found = true;
+          break;
         } 
     }
-  return false;
+  inode_unlock_shared (dir->inode);
+  return found;
 }
@@ -7,16 +7,21 @@
 
 /* Maximum length of a file name component.
    This is the traditional UNIX maximum length.
-   After directories are implemented, this maximum length may be
-   retained, but much longer full path names must be allowed. */
+   It applies to each component of a path; full path names may
+   be much longer. */
 #define NAME_MAX 14
 
 struct inode;
+struct dir_index;
+
+void dir_init (void);
 
 /* Opening and closing directories. */
-bool dir_create (block_sector_t sector, size_t entry_cnt);
+bool dir_create (block_sector_t sector, block_sector_t parent_sector,
+                 size_t entry_cnt);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
+struct dir *dir_open_cwd (void);
 struct dir *dir_reopen (struct dir *);
 void dir_close (struct dir *);
 struct inode *dir_get_inode (struct dir *);
@@ -26,5 +31,10 @@ bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, block_sector_t);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+bool dir_readdir_sector (struct dir *, char name[NAME_MAX + 1],
+                         block_sector_t *);
+
+/* Lookup index. */
+void dir_index_destroy (struct dir_index *);
 
 #endif /* filesys/directory.h */
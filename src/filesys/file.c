@@ -1,8 +1,14 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <stdint.h>
+#include "devices/block.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
+/* Largest piece of a write done in one journal handle. */
+#define WRITE_CHUNK (32 * BLOCK_SECTOR_SIZE)
+
 /* An open file. */
 struct file 
   {
@@ -68,7 +74,11 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read;
+
+  inode_lock_shared (file->inode);
+  bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  inode_unlock_shared (file->inode);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,20 +91,24 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read;
+
+  inode_lock_shared (file->inode);
+  bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  inode_unlock_shared (file->inode);
+  return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file grows the file.
    Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -102,15 +116,37 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file grows the file.
    The file's current position is unaffected. */
 off_t
-file_write_at (struct file *file, const void *buffer, off_t size,
+file_write_at (struct file *file, const void *buffer_, off_t size,
                off_t file_ofs) 
 {
-  return inode_write_at (file->inode, buffer, size, file_ofs);
+  const uint8_t *buffer = buffer_;
+  off_t bytes_written = 0;
+
+  /* Write in pieces, each in its own journal handle, so that the
+     metadata one handle dirties (the inode, a few index blocks
+     and free map sectors) stays within its journal credits. */
+  while (size > 0)
+    {
+      off_t chunk_size = size < WRITE_CHUNK ? size : WRITE_CHUNK;
+      off_t chunk_written;
+
+      journal_begin ();
+      inode_lock_exclusive (file->inode);
+      chunk_written = inode_write_at (file->inode, buffer + bytes_written,
+                                      chunk_size, file_ofs + bytes_written);
+      inode_unlock_exclusive (file->inode);
+      journal_end ();
+
+      bytes_written += chunk_written;
+      size -= chunk_written;
+      if (chunk_written < chunk_size)
+        break;
+    }
+  return bytes_written;
 }
 
 /* Prevents write operations on FILE's underlying inode
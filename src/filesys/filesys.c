@@ -2,15 +2,19 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "filesys/directory.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
 static void do_format (void);
+static struct dir *resolve (const char *path, char name[NAME_MAX + 1]);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -21,8 +25,17 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  /* Bring the disk to a consistent state before anything reads
+     it through the cache. */
+  if (format)
+    journal_format ();
+  journal_recover ();
+
+  cache_init ();
   inode_init ();
+  dir_init ();
   free_map_init ();
+  journal_init ();
 
   if (format) 
     do_format ();
@@ -35,10 +48,15 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  free_map_release_deferred ();
+  journal_done ();
   free_map_close ();
+  cache_done ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
+   NAME may be an absolute path or one relative to the running
+   thread's working directory.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
    or if internal memory allocation fails. */
@@ -46,19 +64,64 @@ bool
 filesys_create (const char *name, off_t initial_size) 
 {
   block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = resolve (name, base);
+  success = (dir != NULL
+             && free_map_allocate (1, &inode_sector)
+             && inode_create (inode_sector, initial_size, false)
+             && dir_add (dir, base, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Creates a directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name) 
+{
+  block_sector_t inode_sector = 0;
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = resolve (name, base);
+  success = (dir != NULL
+             && free_map_allocate (1, &inode_sector)
+             && dir_create (inode_sector,
+                            inode_get_inumber (dir_get_inode (dir)), 16)
+             && dir_add (dir, base, inode_sector));
+  if (!success && inode_sector != 0) 
+    {
+      /* dir_create() has written the new inode, and has probably
+         allocated a data block for "." and "..".  Removing the
+         inode frees both. */
+      struct inode *inode = inode_open (inode_sector);
+      if (inode != NULL)
+        {
+          inode_remove (inode);
+          inode_close (inode);
+        }
+      else
+        free_map_release (inode_sector, 1);
+    }
+  dir_close (dir);
+  journal_end ();
 
   return success;
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file or directory with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
    Fails if no file named NAME exists,
@@ -66,38 +129,158 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  char base[NAME_MAX + 1];
+  struct dir *dir = resolve (name, base);
   struct inode *inode = NULL;
 
   if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+    dir_lookup (dir, base, &inode);
   dir_close (dir);
 
   return file_open (inode);
 }
 
-/* Deletes the file named NAME.
+/* Changes the running thread's working directory to NAME.
+   Returns true if successful, false on failure.
+   Fails if NAME does not exist or is not a directory. */
+bool
+filesys_chdir (const char *name) 
+{
+  char base[NAME_MAX + 1];
+  struct dir *dir = resolve (name, base);
+  struct inode *inode = NULL;
+  struct thread *cur = thread_current ();
+
+  if (dir != NULL)
+    dir_lookup (dir, base, &inode);
+  dir_close (dir);
+
+  if (inode == NULL || !inode_is_dir (inode))
+    {
+      inode_close (inode);
+      return false;
+    }
+  dir_close (cur->cwd);
+  cur->cwd = dir_open (inode);
+  return cur->cwd != NULL;
+}
+
+/* Deletes the file or empty directory named NAME.
    Returns true if successful, false on failure.
    Fails if no file named NAME exists,
    or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char base[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = resolve (name, base);
+  success = dir != NULL && dir_remove (dir, base);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
 
+/* Extracts a file name part from *SRCP into PART, and updates
+   *SRCP so that the next call will return the next file name
+   part.  Returns 1 if successful, 0 at end of string, -1 for a
+   too-long file name part. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp) 
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX characters from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0') 
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++; 
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
+/* Resolves PATH, which is absolute if it begins with "/" and
+   otherwise relative to the running thread's working directory.
+   Returns the directory that contains PATH's last component,
+   which the caller must close, and copies that component into
+   NAME.  A path with no components, such as "/", names the
+   starting directory itself, as ".".
+   Returns a null pointer if PATH is empty, if a component is
+   too long, or if an intermediate component does not exist or
+   is not a directory. */
+static struct dir *
+resolve (const char *path, char name[NAME_MAX + 1]) 
+{
+  char next[NAME_MAX + 1];
+  struct dir *dir;
+  int result;
+
+  if (*path == '\0')
+    return NULL;
+
+  dir = *path == '/' ? dir_open_root () : dir_open_cwd ();
+  if (dir == NULL)
+    return NULL;
+
+  result = get_next_part (name, &path);
+  if (result == 0)
+    strlcpy (name, ".", NAME_MAX + 1);
+  while (result > 0 && (result = get_next_part (next, &path)) > 0)
+    {
+      struct inode *inode;
+
+      /* Descend into NAME. */
+      dir_lookup (dir, name, &inode);
+      dir_close (dir);
+      if (inode == NULL || !inode_is_dir (inode))
+        {
+          inode_close (inode);
+          return NULL;
+        }
+      dir = dir_open (inode);
+      if (dir == NULL)
+        return NULL;
+      strlcpy (name, next, NAME_MAX + 1);
+    }
+
+  if (result < 0)
+    {
+      dir_close (dir);
+      return NULL;
+    }
+  return dir;
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  journal_begin ();
+  if (!dir_create (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_end ();
+  journal_commit ();
   free_map_close ();
   printf ("done.\n");
 }
@@ -1,12 +1,325 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <stdio.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects free_map and its file. */
+
+/* The bitmap is the on-disk truth, but searching it is linear in
+   the size of the disk.  Allocation instead goes through an
+   in-memory index of the maximal runs of free sectors
+   ("extents"), which is rebuilt from the bitmap whenever the
+   bitmap is loaded.
+
+   Each extent is in two hash tables, keyed by its first sector
+   and by the sector just past its end, so that a released range
+   can be merged with its free neighbors in constant time.  Each
+   extent is also on one of the size-bucketed lists, where bucket
+   N holds extents of 2**N to 2**(N+1) - 1 sectors, so that a
+   best-fit search only looks at extents that are large enough.
+
+   Extents live in memory only, so failing to allocate one merely
+   hides some free sectors from the allocator until the next
+   mount; the bitmap never loses them.
+
+   Released sectors are marked free in the bitmap at once, as
+   part of the running journal transaction, but they join the
+   index only when that transaction commits: until then a crash
+   would bring back the metadata that uses them, so they must not
+   be overwritten.  A release that the running journal handle has
+   no credits left for is deferred, with the sectors still marked
+   in use, until free_map_release_deferred() performs it in a
+   handle of its own; a crash before then leaks those sectors,
+   which fsck can repair. */
+
+/* Number of size buckets: one per bit in a sector count. */
+#define BUCKET_CNT 32
+
+/* Sectors whose bits share one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors of the free map file to write in one journal handle
+   when writing the whole map.  The rest of the handle's credits
+   cover the file's inode and index blocks. */
+#define WRITE_SECTORS (HANDLE_CREDITS - 4)
+
+/* A maximal run of free sectors. */
+struct extent
+  {
+    block_sector_t start;            /* First free sector. */
+    block_sector_t length;           /* Number of free sectors. */
+    struct hash_elem start_elem;     /* Element in extents_by_start. */
+    struct hash_elem end_elem;       /* Element in extents_by_end. */
+    struct list_elem bucket_elem;    /* Element in a size bucket,
+                                        uncommitted or deferred. */
+  };
+
+static struct hash extents_by_start; /* Extents keyed by start. */
+static struct hash extents_by_end;   /* Extents keyed by start + length. */
+static struct list buckets[BUCKET_CNT];
+
+/* Runs of released sectors that are not in the index, as struct
+   extents: those freed in the running transaction, and those
+   whose release is deferred. */
+static struct list uncommitted;
+static struct list deferred;
+
+static void build_extents (void);
+
+/* Returns the hash bucket key of extent E in extents_by_start. */
+static unsigned
+extent_start_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct extent *x = hash_entry (e, struct extent, start_elem);
+  return hash_int (x->start);
+}
+
+/* Returns true if extent A starts before extent B. */
+static bool
+extent_start_less (const struct hash_elem *a, const struct hash_elem *b,
+                   void *aux UNUSED)
+{
+  return (hash_entry (a, struct extent, start_elem)->start
+          < hash_entry (b, struct extent, start_elem)->start);
+}
+
+/* Returns the hash bucket key of extent E in extents_by_end. */
+static unsigned
+extent_end_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct extent *x = hash_entry (e, struct extent, end_elem);
+  return hash_int (x->start + x->length);
+}
+
+/* Returns true if extent A ends before extent B. */
+static bool
+extent_end_less (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  const struct extent *x = hash_entry (a, struct extent, end_elem);
+  const struct extent *y = hash_entry (b, struct extent, end_elem);
+  return x->start + x->length < y->start + y->length;
+}
+
+/* Returns the size bucket for an extent of LENGTH sectors. */
+static int
+bucket_of (block_sector_t length)
+{
+  ASSERT (length > 0);
+  return 31 - __builtin_clz (length);
+}
+
+/* Adds extent X, whose start and length are set, to the index. */
+static void
+extent_insert (struct extent *x)
+{
+  hash_insert (&extents_by_start, &x->start_elem);
+  hash_insert (&extents_by_end, &x->end_elem);
+  list_push_front (&buckets[bucket_of (x->length)], &x->bucket_elem);
+}
+
+/* Removes extent X from the index, without freeing it. */
+static void
+extent_remove (struct extent *x)
+{
+  hash_delete (&extents_by_start, &x->start_elem);
+  hash_delete (&extents_by_end, &x->end_elem);
+  list_remove (&x->bucket_elem);
+}
+
+/* Returns the extent that starts at SECTOR, or a null pointer. */
+static struct extent *
+extent_starting_at (block_sector_t sector)
+{
+  struct extent key;
+  struct hash_elem *e;
+
+  key.start = sector;
+  e = hash_find (&extents_by_start, &key.start_elem);
+  return e != NULL ? hash_entry (e, struct extent, start_elem) : NULL;
+}
+
+/* Returns the extent that ends just before SECTOR, or a null
+   pointer. */
+static struct extent *
+extent_ending_at (block_sector_t sector)
+{
+  struct extent key;
+  struct hash_elem *e;
+
+  key.start = sector;
+  key.length = 0;
+  e = hash_find (&extents_by_end, &key.end_elem);
+  return e != NULL ? hash_entry (e, struct extent, end_elem) : NULL;
+}
+
+/* Returns the smallest extent of at least CNT sectors, or a null
+   pointer if there is none. */
+static struct extent *
+extent_best_fit (size_t cnt)
+{
+  int b;
+
+  for (b = bucket_of (cnt); b < BUCKET_CNT; b++)
+    {
+      struct extent *best = NULL;
+      struct list_elem *e;
+
+      for (e = list_begin (&buckets[b]); e != list_end (&buckets[b]);
+           e = list_next (e))
+        {
+          struct extent *x = list_entry (e, struct extent, bucket_elem);
+          if (x->length >= cnt && (best == NULL || x->length < best->length))
+            best = x;
+        }
+      if (best != NULL)
+        return best;
+    }
+  return NULL;
+}
+
+/* Takes CNT sectors off the front of extent X and returns the
+   first of them. */
+static block_sector_t
+extent_take (struct extent *x, size_t cnt)
+{
+  block_sector_t sector = x->start;
+
+  ASSERT (x->length >= cnt);
+
+  extent_remove (x);
+  x->start += cnt;
+  x->length -= cnt;
+  if (x->length > 0)
+    extent_insert (x);
+  else
+    free (x);
+  return sector;
+}
+
+/* Records CNT sectors starting at SECTOR as free in the index,
+   merging them with the free extents on either side. */
+static void
+extent_add (block_sector_t sector, size_t cnt)
+{
+  struct extent *before = extent_ending_at (sector);
+  struct extent *after = extent_starting_at (sector + cnt);
+
+  if (before != NULL)
+    {
+      extent_remove (before);
+      before->length += cnt;
+      if (after != NULL)
+        {
+          extent_remove (after);
+          before->length += after->length;
+          free (after);
+        }
+      extent_insert (before);
+    }
+  else if (after != NULL)
+    {
+      extent_remove (after);
+      after->start = sector;
+      after->length += cnt;
+      extent_insert (after);
+    }
+  else
+    {
+      struct extent *x = malloc (sizeof *x);
+      if (x != NULL)
+        {
+          x->start = sector;
+          x->length = cnt;
+          extent_insert (x);
+        }
+    }
+}
+
+/* Frees extent E.  Used as a hash_action_func. */
+static void
+extent_destroy (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct extent, start_elem));
+}
+
+/* Appends the CNT sectors starting at SECTOR to LIST of runs,
+   extending the last run if they follow it.  Without memory, the
+   sectors are left off, and so are unavailable until the next
+   mount, or with DEFERRED, until fsck repairs the free map. */
+static void
+list_add_run (struct list *list, block_sector_t sector, size_t cnt) 
+{
+  struct extent *x;
+
+  if (!list_empty (list))
+    {
+      x = list_entry (list_back (list), struct extent, bucket_elem);
+      if (x->start + x->length == sector)
+        {
+          x->length += cnt;
+          return;
+        }
+    }
+
+  x = malloc (sizeof *x);
+  if (x != NULL)
+    {
+      x->start = sector;
+      x->length = cnt;
+      list_push_back (list, &x->bucket_elem);
+    }
+}
+
+/* Sets the bits for every run on LIST to VALUE. */
+static void
+mark_runs (struct list *list, bool value) 
+{
+  struct list_elem *e;
+
+  for (e = list_begin (list); e != list_end (list); e = list_next (e))
+    {
+      struct extent *x = list_entry (e, struct extent, bucket_elem);
+      bitmap_set_multiple (free_map, x->start, x->length, value);
+    }
+}
+
+/* Discards the whole index and rebuilds it from the bitmap,
+   leaving out sectors freed by the running transaction. */
+static void
+build_extents (void)
+{
+  size_t start, end;
+  int b;
+
+  hash_clear (&extents_by_end, NULL);
+  hash_clear (&extents_by_start, extent_destroy);
+  for (b = 0; b < BUCKET_CNT; b++)
+    list_init (&buckets[b]);
+
+  mark_runs (&uncommitted, true);
+  for (start = bitmap_scan (free_map, 0, 1, false);
+       start != BITMAP_ERROR;
+       start = bitmap_scan (free_map, end, 1, false))
+    {
+      end = bitmap_scan (free_map, start, 1, true);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (free_map);
+      extent_add (start, end - start);
+    }
+  mark_runs (&uncommitted, false);
+}
 
 /* Initializes the free map. */
 void
@@ -17,6 +330,17 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  lock_init (&free_map_lock);
+  lock_stats_register (&free_map_lock.stats, "free-map");
+  list_init (&uncommitted);
+  list_init (&deferred);
+
+  if (!hash_init (&extents_by_start, extent_start_hash, extent_start_less,
+                  NULL)
+      || !hash_init (&extents_by_end, extent_end_hash, extent_end_less, NULL))
+    PANIC ("free extent index creation failed");
+  build_extents ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -27,26 +351,211 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but if the CNT sectors starting at
+   GOAL are free, allocates those; a file that grows one sector
+   at a time thus stays contiguous when it can.  Otherwise,
+   allocates from the smallest free extent that is large enough
+   (best fit). */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  struct extent *x;
+  block_sector_t sector = BITMAP_ERROR;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  x = extent_starting_at (goal);
+  if (x == NULL || x->length < cnt)
+    x = extent_best_fit (cnt);
+  if (x != NULL)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      sector = extent_take (x, cnt);
+      ASSERT (!bitmap_any (free_map, sector, cnt));
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      if (free_map_file != NULL
+          && !bitmap_write_range (free_map, free_map_file, sector, cnt))
+        {
+          bitmap_set_multiple (free_map, sector, cnt, false); 
+          extent_add (sector, cnt);
+          sector = BITMAP_ERROR;
+        }
     }
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Marks CNT sectors starting at SECTOR free in the free map and
+   its file, and queues them to join the index when the running
+   transaction commits.  The caller must hold free_map_lock and be
+   inside a journal handle. */
+static void
+release_run (block_sector_t sector, size_t cnt) 
+{
+  bitmap_set_multiple (free_map, sector, cnt, false);
+  bitmap_write_range (free_map, free_map_file, sector, cnt);
+  list_add_run (&uncommitted, sector, cnt);
+}
+
+/* Makes CNT sectors starting at SECTOR available for use, once
+   the running journal transaction commits.  The running thread
+   must be inside a journal handle. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  size_t map_sectors = ((sector + cnt - 1) / BITS_PER_SECTOR
+                        - sector / BITS_PER_SECTOR + 1);
+
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  if (journal_has_credits (map_sectors))
+    release_run (sector, cnt);
+  else
+    list_add_run (&deferred, sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Performs the releases that free_map_release() deferred, each
+   in a journal handle that has credits for it.  The running
+   thread must not be inside a journal handle. */
+void
+free_map_release_deferred (void) 
+{
+  bool more;
+
+  lock_acquire (&free_map_lock);
+  more = !list_empty (&deferred);
+  lock_release (&free_map_lock);
+
+  while (more)
+    {
+      journal_begin ();
+      lock_acquire (&free_map_lock);
+      while (!list_empty (&deferred) && journal_has_credits (1))
+        {
+          struct extent *x = list_entry (list_front (&deferred),
+                                         struct extent, bucket_elem);
+
+          /* Release as much as one free map sector covers. */
+          size_t room = (ROUND_DOWN (x->start, BITS_PER_SECTOR)
+                         + BITS_PER_SECTOR - x->start);
+          size_t cnt = x->length < room ? x->length : room;
+
+          release_run (x->start, cnt);
+          x->start += cnt;
+          x->length -= cnt;
+          if (x->length == 0)
+            {
+              list_remove (&x->bucket_elem);
+              free (x);
+            }
+        }
+      more = !list_empty (&deferred);
+      lock_release (&free_map_lock);
+      journal_end ();
+    }
+}
+
+/* Adds the sectors released in the transaction that the journal
+   has just committed to the index, so that they can be allocated
+   again.  Called only by the journal. */
+void
+free_map_committed (void) 
+{
+  lock_acquire (&free_map_lock);
+  while (!list_empty (&uncommitted))
+    {
+      struct extent *x = list_entry (list_pop_front (&uncommitted),
+                                     struct extent, bucket_elem);
+      extent_add (x->start, x->length);
+      free (x);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Writes the whole free map to FILE, WRITE_SECTORS sectors of it
+   per journal handle.  Once the free map is in service, holds
+   free_map_lock while writing each piece, so that it sees no
+   allocation half done.  While formatting, free_map_file is
+   still null and writing FILE allocates its sectors, which takes
+   free_map_lock itself.  The running thread must not be inside a
+   journal handle or hold free_map_lock. */
+static bool
+write_map (struct file *file) 
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t start;
+  bool success = true;
+
+  for (start = 0; start < bit_cnt && success;
+       start += WRITE_SECTORS * BITS_PER_SECTOR)
+    {
+      size_t cnt = bit_cnt - start;
+      if (cnt > WRITE_SECTORS * BITS_PER_SECTOR)
+        cnt = WRITE_SECTORS * BITS_PER_SECTOR;
+
+      journal_begin ();
+      if (free_map_file != NULL)
+        lock_acquire (&free_map_lock);
+      success = bitmap_write_range (free_map, file, start, cnt);
+      if (free_map_file != NULL)
+        lock_release (&free_map_lock);
+      journal_end ();
+    }
+  return success;
+}
+
+/* Compares the free map with USED, which has a bit set for each
+   sector that the file system actually uses, and prints each run
+   of sectors on which they disagree.  If REPAIR is true, makes
+   the free map match USED.  Returns the number of runs found. */
+size_t
+free_map_check (const struct bitmap *used, bool repair) 
+{
+  size_t size = bitmap_size (free_map);
+  size_t runs = 0;
+  size_t start, end;
+
+  ASSERT (bitmap_size (used) == size);
+
+  lock_acquire (&free_map_lock);
+  for (start = 0; start < size; start = end)
+    {
+      bool state = bitmap_test (free_map, start);
+
+      /* Find the run of sectors with the same disagreement. */
+      end = start + 1;
+      if (bitmap_test (used, start) == state)
+        continue;
+      while (end < size && bitmap_test (free_map, end) == state
+             && bitmap_test (used, end) != state)
+        end++;
+
+      printf ("fsck: sectors %zu-%zu %s\n", start, end - 1,
+              state ? "leaked: in use in free map but unreachable"
+                    : "reachable but free in free map");
+      runs++;
+      if (repair)
+        bitmap_set_multiple (free_map, start, end - start, !state);
+    }
+
+  if (repair && runs > 0)
+    {
+      build_extents ();
+      lock_release (&free_map_lock);
+      if (!write_map (free_map_file))
+        printf ("fsck: can't write free map\n");
+      journal_commit ();
+    }
+  else
+    lock_release (&free_map_lock);
+  return runs;
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,6 +567,7 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  build_extents ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -68,18 +578,32 @@ free_map_close (void)
 }
 
 /* Creates a new free map file on disk and writes the free map to
-   it. */
+   it.  The running thread must not be inside a journal handle. */
 void
 free_map_create (void) 
 {
+  struct file *file;
+  bool success;
+
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  journal_begin ();
+  success = inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map),
+                          false);
+  journal_end ();
+  if (!success)
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  The inode starts out as a hole, so
+     the first write allocates the file's sectors, which changes
+     the bitmap as it is being written; write it again to record
+     the final state.  free_map_file stays null until then, so
+     that those allocations do not try to write the free map
+     themselves.  Afterward the free map file has no holes, so
+     writing it never needs to allocate. */
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  if (!write_map (file) || !write_map (file))
     PANIC ("can't write free map");
+  free_map_file = file;
 }
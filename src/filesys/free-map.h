@@ -12,6 +12,12 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (size_t, block_sector_t goal, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_deferred (void);
+void free_map_committed (void);
+
+struct bitmap;
+size_t free_map_check (const struct bitmap *used, bool repair);
 
 #endif /* filesys/free-map.h */
@@ -0,0 +1,286 @@
+#include "filesys/fsck.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/directory.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+
+/* File system consistency checker.
+
+   Walks every inode reachable from the root directory, marking
+   each inode sector and each data and index sector it uses in a
+   bitmap of its own, then compares that bitmap with the free
+   map.  A sector that two inodes claim, or that lies beyond the
+   end of the disk, is reported; these cannot be repaired
+   automatically.  A sector that the free map marks in use but
+   nothing reaches is leaked, and a sector that something reaches
+   but the free map marks free may be handed out twice; with
+   REPAIR, both kinds are fixed in the free map.
+
+   The checker reads through the buffer cache, so it sees the
+   same state as the rest of the file system, but it takes no
+   locks across directories, so it is only correct while the
+   file system is otherwise idle.  Sectors that a running
+   process has allocated but not yet linked into an inode look
+   leaked, so the "fsck-repair" kernel action refuses to run
+   while any user process is alive.
+
+   The checker reads in batches rather than one sector at a
+   time.  It brings each directory's sectors into the cache
+   before reading its entries.  It sorts the inode sectors that a
+   directory names and reads them CACHE_PREFETCH_MAX at a time,
+   in one batch of disk requests each, before checking those
+   inodes.  The block layer merges consecutive sectors in a batch
+   into single transfers.  inode_for_each_sector() reads the
+   index blocks below a doubly indirect block the same way. */
+
+/* Checker state. */
+struct fsck
+  {
+    struct bitmap *used;                /* Sectors found in use. */
+    struct list dirs;                   /* Directories still to scan. */
+    block_sector_t owner;               /* Inode being walked. */
+    size_t inode_cnt;                   /* Inodes found. */
+    size_t dir_cnt;                     /* Directories found. */
+    size_t errors;                      /* Problems found. */
+  };
+
+/* A directory waiting to be scanned. */
+struct pending_dir
+  {
+    struct list_elem elem;              /* Element in struct fsck dirs. */
+    block_sector_t sector;              /* Directory inode sector. */
+  };
+
+/* A directory entry read during a scan. */
+struct child
+  {
+    block_sector_t sector;              /* Inode sector. */
+    char name[NAME_MAX + 1];            /* File name. */
+  };
+
+/* Marks SECTOR in use by the inode in FSCK->owner, reporting it
+   if it is out of range or already in use.  An
+   inode_sector_func. */
+static void
+mark_sector (block_sector_t sector, void *fsck_) 
+{
+  struct fsck *fsck = fsck_;
+
+  if (sector >= block_size (fs_device))
+    {
+      printf ("fsck: inode %"PRDSNu" points past end of disk "
+              "to sector %"PRDSNu"\n", fsck->owner, sector);
+      fsck->errors++;
+    }
+  else if (bitmap_test (fsck->used, sector))
+    {
+      printf ("fsck: sector %"PRDSNu" used twice, again by inode "
+              "%"PRDSNu"\n", sector, fsck->owner);
+      fsck->errors++;
+    }
+  else
+    bitmap_mark (fsck->used, sector);
+}
+
+/* Checks the inode in SECTOR, named NAME, and its data and index
+   sectors.  Queues it for scanning if it is a directory. */
+static void
+check_inode (struct fsck *fsck, block_sector_t sector, const char *name) 
+{
+  struct inode *inode;
+
+  if (sector >= block_size (fs_device)
+      || bitmap_test (fsck->used, sector))
+    {
+      /* Reports the problem.  Don't walk the inode again, which
+         could loop forever on a directory cycle. */
+      fsck->owner = sector;
+      mark_sector (sector, fsck);
+      return;
+    }
+  bitmap_mark (fsck->used, sector);
+
+  inode = inode_open (sector);
+  if (inode == NULL)
+    PANIC ("fsck: out of memory");
+  if (!inode_is_valid (inode))
+    {
+      printf ("fsck: '%s' refers to sector %"PRDSNu", "
+              "which is not an inode\n", name, sector);
+      fsck->errors++;
+      inode_close (inode);
+      return;
+    }
+
+  fsck->inode_cnt++;
+  fsck->owner = sector;
+  inode_lock_shared (inode);
+  inode_for_each_sector (inode, mark_sector, fsck);
+  inode_unlock_shared (inode);
+
+  if (inode_is_dir (inode))
+    {
+      struct pending_dir *p = malloc (sizeof *p);
+      if (p == NULL)
+        PANIC ("fsck: out of memory");
+      p->sector = sector;
+      list_push_back (&fsck->dirs, &p->elem);
+    }
+  inode_close (inode);
+}
+
+/* Sectors of a directory to prefetch. */
+struct dir_sectors
+  {
+    block_sector_t sectors[CACHE_PREFETCH_MAX];
+    size_t cnt;
+  };
+
+/* Adds SECTOR to the struct dir_sectors in DS_, while there is
+   room.  An inode_sector_func. */
+static void
+add_dir_sector (block_sector_t sector, void *ds_) 
+{
+  struct dir_sectors *ds = ds_;
+
+  if (ds->cnt < CACHE_PREFETCH_MAX)
+    ds->sectors[ds->cnt++] = sector;
+}
+
+/* Orders block_sector_t A and B, for qsort(). */
+static int
+compare_sectors (const void *a_, const void *b_) 
+{
+  const block_sector_t *a = a_;
+  const block_sector_t *b = b_;
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Orders struct child A and B by sector, for qsort(). */
+static int
+compare_children (const void *a_, const void *b_) 
+{
+  const struct child *a = a_;
+  const struct child *b = b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Checks every inode named in the directory in SECTOR. */
+static void
+scan_dir (struct fsck *fsck, block_sector_t sector) 
+{
+  struct dir *dir;
+  struct child *children = NULL;
+  size_t cnt = 0, capacity = 0;
+  char name[NAME_MAX + 1];
+  block_sector_t child_sector;
+  block_sector_t batch[CACHE_PREFETCH_MAX];
+  struct dir_sectors *ds;
+  size_t i, j;
+
+  dir = dir_open (inode_open (sector));
+  if (dir == NULL)
+    PANIC ("fsck: out of memory");
+  fsck->dir_cnt++;
+
+  /* Read the start of the directory, which is all of most
+     directories, in one batch. */
+  ds = malloc (sizeof *ds);
+  if (ds != NULL)
+    {
+      ds->cnt = 0;
+      inode_lock_shared (dir_get_inode (dir));
+      inode_for_each_sector (dir_get_inode (dir), add_dir_sector, ds);
+      inode_unlock_shared (dir_get_inode (dir));
+      qsort (ds->sectors, ds->cnt, sizeof *ds->sectors, compare_sectors);
+      cache_prefetch (ds->sectors, ds->cnt);
+      free (ds);
+    }
+
+  /* Read the whole directory first. */
+  while (dir_readdir_sector (dir, name, &child_sector))
+    {
+      if (cnt == capacity)
+        {
+          capacity = capacity ? capacity * 2 : 16;
+          children = realloc (children, capacity * sizeof *children);
+          if (children == NULL)
+            PANIC ("fsck: out of memory");
+        }
+      children[cnt].sector = child_sector;
+      strlcpy (children[cnt].name, name, sizeof children[cnt].name);
+      cnt++;
+    }
+  dir_close (dir);
+
+  /* Read the inodes in disk order, a batch at a time, and check
+     each batch. */
+  qsort (children, cnt, sizeof *children, compare_children);
+  for (i = 0; i < cnt; i += CACHE_PREFETCH_MAX)
+    {
+      size_t batch_cnt = cnt - i < CACHE_PREFETCH_MAX
+                         ? cnt - i : CACHE_PREFETCH_MAX;
+
+      for (j = 0; j < batch_cnt; j++)
+        batch[j] = children[i + j].sector;
+      cache_prefetch (batch, batch_cnt);
+      for (j = 0; j < batch_cnt; j++)
+        check_inode (fsck, children[i + j].sector, children[i + j].name);
+    }
+  free (children);
+}
+
+/* Checks the file system and prints what it finds.  If REPAIR is
+   true, also fixes the free map.  Returns the number of problems
+   found. */
+size_t
+fsck (bool repair) 
+{
+  struct fsck fsck;
+  block_sector_t sector;
+
+  fsck.used = bitmap_create (block_size (fs_device));
+  if (fsck.used == NULL)
+    PANIC ("fsck: out of memory");
+  list_init (&fsck.dirs);
+  fsck.inode_cnt = fsck.dir_cnt = fsck.errors = 0;
+
+  /* Get the disk up to date, so that a crash while checking
+     finds no half-written transaction to replay, and so that
+     sectors whose release was deferred do not look leaked. */
+  free_map_release_deferred ();
+  journal_commit ();
+
+  /* Sectors that belong to no directory entry. */
+  bitmap_set_multiple (fsck.used, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  check_inode (&fsck, FREE_MAP_SECTOR, "free map");
+  check_inode (&fsck, ROOT_DIR_SECTOR, "/");
+
+  /* Scan directories breadth first. */
+  while (!list_empty (&fsck.dirs))
+    {
+      struct pending_dir *p = list_entry (list_pop_front (&fsck.dirs),
+                                          struct pending_dir, elem);
+      sector = p->sector;
+      free (p);
+      scan_dir (&fsck, sector);
+    }
+
+  fsck.errors += free_map_check (fsck.used, repair);
+  printf ("fsck: %zu inodes, %zu directories, %zu sectors in use, "
+          "%zu problems%s\n",
+          fsck.inode_cnt, fsck.dir_cnt,
+          bitmap_count (fsck.used, 0, bitmap_size (fsck.used), true),
+          fsck.errors, repair && fsck.errors ? " (free map repaired)" : "");
+  bitmap_destroy (fsck.used);
+  return fsck.errors;
+}
@@ -0,0 +1,9 @@
+#ifndef FILESYS_FSCK_H
+#define FILESYS_FSCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t fsck (bool repair);
+
+#endif /* filesys/fsck.h */
@@ -1,5 +1,7 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +9,13 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/fsck.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/vaddr.h"
+#ifdef USERPROG
+#include "userprog/process.h"
+#endif
 
 /* List files in the root directory. */
 void
@@ -67,25 +73,117 @@ fsutil_rm (char **argv)
     PANIC ("%s: delete failed\n", file_name);
 }
 
+/* Checks the file system for consistency and reports problems. */
+void
+fsutil_fsck (char **argv UNUSED) 
+{
+  printf ("Checking file system...\n");
+  fsck (false);
+}
+
+/* Checks the file system for consistency and repairs the free
+   map. */
+void
+fsutil_fsck_repair (char **argv UNUSED) 
+{
+#ifdef USERPROG
+  /* A running process may hold sectors that it has allocated but
+     not yet linked into an inode.  The checker would take them
+     for leaked and free them, and they could then be handed out
+     twice. */
+  size_t process_cnt = process_count ();
+  if (process_cnt > 0)
+    {
+      printf ("fsck-repair: %zu user processes running, not repairing\n",
+              process_cnt);
+      return;
+    }
+#endif
+
+  printf ("Checking and repairing file system...\n");
+  fsck (true);
+}
+
+/* Number of pages of scratch device sectors that
+   fsutil_extract() reads at a time. */
+#define EXTRACT_PAGES 8
+
+/* Number of sectors that fsutil_extract() reads at a time. */
+#define EXTRACT_BATCH (EXTRACT_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Reads a block device sequentially in batches of EXTRACT_BATCH
+   sectors. */
+struct batch_reader
+  {
+    struct block *block;                /* Device to read. */
+    block_sector_t next;                /* Next sector to read from device. */
+    uint8_t *buffer;                    /* EXTRACT_BATCH sectors. */
+    size_t pos;                         /* Next unconsumed sector in buffer. */
+    size_t cnt;                         /* Number of sectors in buffer. */
+  };
+
+/* Returns the number of the sector that the next call to
+   batch_next() will return first. */
+static block_sector_t
+batch_sector (const struct batch_reader *r) 
+{
+  return r->next - r->cnt + r->pos;
+}
+
+/* Returns up to MAX_CNT consecutive sectors from R, reading the
+   next batch from the device if none are buffered, and stores
+   the number returned in *CNT. */
+static const uint8_t *
+batch_next (struct batch_reader *r, size_t max_cnt, size_t *cnt) 
+{
+  const uint8_t *data;
+
+  ASSERT (max_cnt > 0);
+
+  if (r->pos == r->cnt)
+    {
+      block_sector_t left = block_size (r->block) - r->next;
+      if (left == 0)
+        PANIC ("unexpected end of scratch device");
+      r->cnt = left < EXTRACT_BATCH ? left : EXTRACT_BATCH;
+      r->pos = 0;
+      block_read_multi (r->block, r->next, r->cnt, r->buffer);
+      r->next += r->cnt;
+    }
+
+  *cnt = r->cnt - r->pos < max_cnt ? r->cnt - r->pos : max_cnt;
+  data = r->buffer + r->pos * BLOCK_SECTOR_SIZE;
+  r->pos += *cnt;
+  return data;
+}
+
 /* Extracts a ustar-format tar archive from the scratch block
-   device into the Pintos file system. */
+   device into the Pintos file system.
+
+   The archive is read in batches of EXTRACT_BATCH sectors, and
+   each file's data is written straight out of the batch buffer
+   in runs as long as the buffer allows.  Files are created
+   without zero-filling their data sectors, so each data sector
+   is written only once. */
 void
 fsutil_extract (char **argv UNUSED) 
 {
   static block_sector_t sector = 0;
 
-  struct block *src;
-  void *header, *data;
+  struct batch_reader src;
+  void *header;
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
-  if (header == NULL || data == NULL)
+  src.buffer = palloc_get_multiple (0, EXTRACT_PAGES);
+  if (header == NULL || src.buffer == NULL)
     PANIC ("couldn't allocate buffers");
+  src.next = sector;
+  src.pos = src.cnt = 0;
 
   /* Open source block device. */
-  src = block_get_role (BLOCK_SCRATCH);
-  if (src == NULL)
+  src.block = block_get_role (BLOCK_SCRATCH);
+  if (src.block == NULL)
     PANIC ("couldn't open scratch device");
 
   printf ("Extracting ustar archive from scratch device "
@@ -96,13 +194,17 @@ fsutil_extract (char **argv UNUSED)
       const char *file_name;
       const char *error;
       enum ustar_type type;
+      block_sector_t header_sector;
+      size_t cnt;
       int size;
 
       /* Read and parse ustar header. */
-      block_read (src, sector++, header);
+      header_sector = batch_sector (&src);
+      memcpy (header, batch_next (&src, 1, &cnt), BLOCK_SECTOR_SIZE);
       error = ustar_parse_header (header, &file_name, &type, &size);
       if (error != NULL)
-        PANIC ("bad ustar header in sector %"PRDSNu" (%s)", sector - 1, error);
+        PANIC ("bad ustar header in sector %"PRDSNu" (%s)",
+               header_sector, error);
 
       if (type == USTAR_EOF)
         {
@@ -110,7 +212,12 @@ fsutil_extract (char **argv UNUSED)
           break;
         }
       else if (type == USTAR_DIRECTORY)
-        printf ("ignoring directory %s\n", file_name);
+        {
+          printf ("Creating directory '%s'...\n", file_name);
+          if (!filesys_mkdir (file_name))
+            printf ("%s: mkdir failed, perhaps it already exists\n",
+                    file_name);
+        }
       else if (type == USTAR_REGULAR)
         {
           struct file *dst;
@@ -124,13 +231,17 @@ fsutil_extract (char **argv UNUSED)
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
-          /* Do copy. */
+          /* Do copy, as many sectors at a time as are buffered. */
           while (size > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
-                                : size);
-              block_read (src, sector++, data);
+              const uint8_t *data;
+              int chunk_size;
+
+              data = batch_next (&src, DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE),
+                                 &cnt);
+              chunk_size = (size > (int) (cnt * BLOCK_SECTOR_SIZE)
+                            ? (int) (cnt * BLOCK_SECTOR_SIZE)
+                            : size);
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
@@ -148,10 +259,11 @@ fsutil_extract (char **argv UNUSED)
      end-of-archive marker. */
   printf ("Erasing ustar archive...\n");
   memset (header, 0, BLOCK_SECTOR_SIZE);
-  block_write (src, 0, header);
-  block_write (src, 1, header);
+  block_write (src.block, 0, header);
+  block_write (src.block, 1, header);
+  sector = batch_sector (&src);
 
-  free (data);
+  palloc_free_multiple (src.buffer, EXTRACT_PAGES);
   free (header);
 }
 
@@ -4,6 +4,8 @@
 void fsutil_ls (char **argv);
 void fsutil_cat (char **argv);
 void fsutil_rm (char **argv);
+void fsutil_fsck (char **argv);
+void fsutil_fsck_repair (char **argv);
 void fsutil_extract (char **argv);
 void fsutil_append (char **argv);
 
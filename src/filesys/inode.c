@@ -1,23 +1,54 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/directory.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of sector numbers that fit in an indirect block. */
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Number of direct sector pointers in an inode. */
+#define DIRECT_CNT 123
+
+/* Largest number of data sectors that one inode can index. */
+#define MAX_SECTORS (DIRECT_CNT + PTRS_PER_SECTOR \
+                     + PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+
+/* Shortest run of whole, contiguous sectors that inode_read_at()
+   and inode_write_at() move directly between the disk and the
+   caller's buffer instead of through the buffer cache: one
+   page. */
+#define DIRECT_IO_MIN 8
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   Data sectors are indexed by DIRECT_CNT direct pointers, then
+   through one indirect block of PTRS_PER_SECTOR pointers, then
+   through a doubly indirect block of pointers to indirect blocks.
+   A pointer of 0 means that the data sector (or the whole range
+   covered by an indirect block) has not been allocated yet; such
+   holes read as zeros.  Sector 0 always holds the free map's
+   inode, so it can never be a data or index sector. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t is_dir;                    /* 1 for a directory, 0 for a file. */
+    block_sector_t direct[DIRECT_CNT];  /* Direct data sectors. */
+    block_sector_t indirect;            /* Indirect block. */
+    block_sector_t doubly_indirect;     /* Doubly indirect block. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -31,46 +62,125 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem free_elem;         /* Element in free_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct rwlock rwlock;               /* Shared by readers, exclusive for writers. */
+    struct dir_index *dir_index;        /* Directory lookup index, or null. */
     struct inode_disk data;             /* Inode content. */
   };
 
+static block_sector_t index_sector (struct inode_disk *, size_t idx,
+                                    block_sector_t *goal, bool *changed);
+static void deallocate (struct inode_disk *);
+
+/* Returns true if INODE's contents are file system metadata,
+   which must be journaled, as for a directory or the free map. */
+static bool
+is_metadata (const struct inode *inode) 
+{
+  return inode->data.is_dir || inode->sector == FREE_MAP_SECTOR;
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   If that sector has not been allocated and GOAL is non-null,
+   allocates a zeroed sector for it as close to *GOAL as possible,
+   advances *GOAL past it, and sets *CHANGED to true if INODE's
+   on-disk inode must be written back as a result.
+   Returns 0 if there is no sector for POS, either because it is
+   a hole and GOAL is null or because allocation failed. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos, block_sector_t *goal,
+                bool *changed) 
 {
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
-    return -1;
+  ASSERT (pos >= 0);
+  return index_sector (&inode->data, pos / BLOCK_SECTOR_SIZE,
+                       goal, changed);
+}
+
+/* Returns the length, in sectors, of the run of whole sectors of
+   INODE that starts at OFFSET, whose sector is SECTOR, and that
+   lie in consecutive sectors on disk, considering at most LEFT
+   bytes.  Returns 0 if OFFSET is not sector-aligned or the run
+   is shorter than DIRECT_IO_MIN.  GOAL and CHANGED are passed to
+   byte_to_sector(), so that a writer can allocate the run as it
+   goes. */
+static size_t
+direct_run (struct inode *inode, block_sector_t sector, off_t offset,
+            off_t left, block_sector_t *goal, bool *changed) 
+{
+  size_t max_cnt = left / BLOCK_SECTOR_SIZE;
+  size_t cnt;
+
+  if (sector == 0 || offset % BLOCK_SECTOR_SIZE != 0
+      || max_cnt < DIRECT_IO_MIN)
+    return 0;
+
+  for (cnt = 1; cnt < max_cnt; cnt++)
+    if (byte_to_sector (inode, offset + cnt * BLOCK_SECTOR_SIZE,
+                        goal, changed) != sector + cnt)
+      break;
+  return cnt >= DIRECT_IO_MIN ? cnt : 0;
+}
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Closed inodes kept for reuse, so that a busy open/close cycle
+   does not go through malloc() and free() every time.  At most
+   FREE_INODES_MAX are kept. */
+static struct list free_inodes;
+static size_t free_inode_cnt;
+#define FREE_INODES_MAX 64
+
+/* Protects open_inodes, free_inodes and each inode's
+   open_cnt. */
+static struct lock open_inodes_lock;
+
+/* Returns the hash value of inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns true if inode A's sector precedes inode B's. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED) 
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table creation failed");
+  list_init (&free_inodes);
+  free_inode_cnt = 0;
+  lock_init (&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The inode is a directory if IS_DIR is true and an
+   ordinary file otherwise.  No data sectors are allocated: the
+   whole file starts out as a hole that reads as zeros, and
+   inode_write_at() allocates sectors as they are first written.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails or LENGTH exceeds the
+   maximum file size. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -84,22 +194,12 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
+      disk_inode->is_dir = is_dir;
+      success = bytes_to_sectors (length) <= MAX_SECTORS;
+      if (success)
+        cache_write_meta (sector, disk_inode);
       free (disk_inode);
     }
   return success;
@@ -111,33 +211,50 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
+  lock_acquire (&open_inodes_lock);
+
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
+    {
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode; 
+    }
+
+  /* Allocate memory, preferably by reusing a closed inode. */
+  if (!list_empty (&free_inodes))
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode = list_entry (list_pop_front (&free_inodes),
+                          struct inode, free_elem);
+      free_inode_cnt--;
+    }
+  else
+    {
+      inode = malloc (sizeof *inode);
+      if (inode == NULL)
         {
-          inode_reopen (inode);
-          return inode; 
+          lock_release (&open_inodes_lock);
+          return NULL;
         }
     }
 
-  /* Allocate memory. */
-  inode = malloc (sizeof *inode);
-  if (inode == NULL)
-    return NULL;
-
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
+  hash_insert (&open_inodes, &inode->elem);
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->dir_index = NULL;
+  rwlock_init (&inode->rwlock, false);
+  cache_read (inode->sector, &inode->data);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -146,7 +263,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -168,21 +289,37 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&open_inodes_lock);
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      /* Remove from inode table and release lock. */
+      hash_delete (&open_inodes, &inode->elem);
+      lock_release (&open_inodes_lock);
  
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
+          journal_begin ();
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          deallocate (&inode->data);
+          journal_end ();
         }
 
+      dir_index_destroy (inode->dir_index);
+
+      /* Keep the memory for reuse if there is room. */
+      lock_acquire (&open_inodes_lock);
+      if (free_inode_cnt < FREE_INODES_MAX)
+        {
+          list_push_front (&free_inodes, &inode->free_elem);
+          free_inode_cnt++;
+          inode = NULL;
+        }
+      lock_release (&open_inodes_lock);
       free (inode); 
     }
+  else
+    lock_release (&open_inodes_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -194,20 +331,66 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Returns true if INODE is a directory, false if it is an
+   ordinary file. */
+bool
+inode_is_dir (const struct inode *inode) 
+{
+  return inode->data.is_dir != 0;
+}
+
+/* Returns true if INODE has been removed, so that it will be
+   deleted when it is last closed. */
+bool
+inode_is_removed (const struct inode *inode) 
+{
+  return inode->removed;
+}
+
+/* Acquires INODE's lock for reading.  Any number of threads may
+   hold it this way at once, but not while a writer holds it. */
+void
+inode_lock_shared (struct inode *inode) 
+{
+  rwlock_acquire_read (&inode->rwlock);
+}
+
+/* Releases INODE's lock, held for reading. */
+void
+inode_unlock_shared (struct inode *inode) 
+{
+  rwlock_release_read (&inode->rwlock);
+}
+
+/* Acquires INODE's lock for writing, excluding all other readers
+   and writers. */
+void
+inode_lock_exclusive (struct inode *inode) 
+{
+  rwlock_acquire_write (&inode->rwlock);
+}
+
+/* Releases INODE's lock, held for writing. */
+void
+inode_unlock_exclusive (struct inode *inode) 
+{
+  rwlock_release_write (&inode->rwlock);
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   The caller must hold INODE's lock, in either mode. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = byte_to_sector (inode, offset, NULL, NULL);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -217,102 +400,120 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
       /* Number of bytes to actually copy out of this sector. */
       int chunk_size = size < min_left ? size : min_left;
+      size_t run;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      /* Read a long run of whole sectors straight from the disk
+         into BUFFER.  Otherwise, copy out of the buffer cache.  A
+         hole reads as zeros. */
+      run = direct_run (inode, sector_idx, offset,
+                        size < inode_left ? size : inode_left, NULL, NULL);
+      if (run > 0)
         {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          cache_read_direct (sector_idx, run, buffer + bytes_read);
+          chunk_size = run * BLOCK_SECTOR_SIZE;
         }
+      else if (sector_idx != 0)
+        cache_read_at (sector_idx, buffer + bytes_read,
+                       sector_ofs, chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  /* Start fetching the sector after the last one read, on the
+     guess that the caller is reading sequentially. */
+  if (bytes_read > 0 && offset < inode_length (inode)
+      && offset % BLOCK_SECTOR_SIZE == 0)
+    {
+      block_sector_t next = byte_to_sector (inode, offset, NULL, NULL);
+      if (next != 0)
+        cache_readahead (next);
+    }
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or the inode reaches its
+   maximum size.  Writing past end of file extends the inode;
+   any gap between the old end of file and OFFSET becomes a hole
+   that reads as zeros.
+   The caller must hold INODE's lock exclusively. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool changed = false;
+  block_sector_t goal = inode->sector + 1;
 
   if (inode->deny_write_cnt)
     return 0;
 
+  /* Place new sectors right after the ones that precede them. */
+  if (offset > 0)
+    {
+      block_sector_t prev = byte_to_sector (inode, offset - 1, NULL, NULL);
+      if (prev != 0)
+        goal = prev + 1;
+    }
+
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = byte_to_sector (inode, offset, &goal,
+                                                  &changed);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in sector. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
+      int chunk_size = size < sector_left ? size : sector_left;
+      size_t run;
+      if (sector_idx == 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
+      /* Write a long run of whole sectors of file data straight
+         from BUFFER to the disk, allocating it first.  Otherwise,
+         copy into the buffer cache, which reads in the rest of
+         the sector first if the chunk does not cover it. */
+      run = (is_metadata (inode) ? 0
+             : direct_run (inode, sector_idx, offset, size, &goal, &changed));
+      if (run > 0)
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
+          cache_write_direct (sector_idx, run, buffer + bytes_written);
+          chunk_size = run * BLOCK_SECTOR_SIZE;
         }
+      else if (is_metadata (inode))
+        cache_write_meta_at (sector_idx, buffer + bytes_written,
+                             sector_ofs, chunk_size);
+      else
+        cache_write_at (sector_idx, buffer + bytes_written,
+                      sector_ofs, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Extend the file to cover what we wrote. */
+  if (offset > inode->data.length)
+    {
+      inode->data.length = offset;
+      changed = true;
+    }
+  if (changed)
+    cache_write_meta (inode->sector, &inode->data);
 
   return bytes_written;
 }
@@ -322,8 +523,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  inode_lock_exclusive (inode);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  inode_unlock_exclusive (inode);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +535,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  inode_lock_exclusive (inode);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  inode_unlock_exclusive (inode);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +548,198 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns the directory lookup index attached to INODE, or a
+   null pointer if there is none. */
+struct dir_index *
+inode_get_dir_index (const struct inode *inode)
+{
+  return inode->dir_index;
+}
+
+/* Attaches directory lookup index INDEX to INODE.  INODE takes
+   ownership and destroys it when it is last closed. */
+void
+inode_set_dir_index (struct inode *inode, struct dir_index *index)
+{
+  inode->dir_index = index;
+}
+
+/* Allocates a sector as close to *GOAL as possible, fills it
+   with zeros, advances *GOAL just past it and returns it.  The
+   zeros are journaled if META is true.
+   Returns 0 if the disk is full. */
+static block_sector_t
+allocate_zeroed (block_sector_t *goal, bool meta) 
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+
+  if (!free_map_allocate_near (1, *goal, &sector))
+    return 0;
+  if (meta)
+    cache_write_meta (sector, zeros);
+  else
+    cache_write (sector, zeros);
+  *goal = sector + 1;
+  return sector;
+}
+
+/* Returns the sector stored in *SLOTP, first allocating a zeroed
+   sector near *GOAL for it if it is 0 and GOAL is non-null, in
+   which case *CHANGED is set to true.  A new sector holds
+   metadata if META is true.  Returns 0 for an unallocated
+   slot. */
+static block_sector_t
+slot_sector (block_sector_t *slotp, block_sector_t *goal, bool meta,
+             bool *changed) 
+{
+  if (*slotp == 0 && goal != NULL)
+    {
+      *slotp = allocate_zeroed (goal, meta);
+      if (*slotp != 0)
+        *changed = true;
+    }
+  return *slotp;
+}
+
+/* Returns the sector stored in entry IDX of indirect block BLOCK,
+   first allocating a zeroed sector near *GOAL for it if it is 0
+   and GOAL is non-null.  A new sector holds metadata if META is
+   true.  Returns 0 for an unallocated entry. */
+static block_sector_t
+indirect_sector (block_sector_t block, size_t idx, block_sector_t *goal,
+                 bool meta) 
+{
+  block_sector_t sector;
+  bool changed = false;
+
+  ASSERT (idx < PTRS_PER_SECTOR);
+
+  cache_read_at (block, &sector, idx * sizeof sector, sizeof sector);
+  slot_sector (&sector, goal, meta, &changed);
+  if (changed)
+    cache_write_meta_at (block, &sector, idx * sizeof sector, sizeof sector);
+  return sector;
+}
+
+/* Returns the sector that holds data sector IDX of DISK, walking
+   the direct, indirect and doubly indirect pointers.  Missing
+   sectors, including index blocks, are allocated near *GOAL if
+   GOAL is non-null; if that changes DISK itself, *CHANGED is set
+   to true.  Returns 0 if the sector does not exist or cannot be
+   allocated. */
+static block_sector_t
+index_sector (struct inode_disk *disk, size_t idx, block_sector_t *goal,
+              bool *changed) 
+{
+  /* Directory contents are metadata; file contents are not. */
+  bool meta = disk->is_dir != 0;
+  block_sector_t block;
+
+  ASSERT (goal == NULL || changed != NULL);
+
+  if (idx < DIRECT_CNT)
+    return slot_sector (&disk->direct[idx], goal, meta, changed);
+  idx -= DIRECT_CNT;
+
+  if (idx < PTRS_PER_SECTOR)
+    {
+      block = slot_sector (&disk->indirect, goal, true, changed);
+      return block != 0 ? indirect_sector (block, idx, goal, meta) : 0;
+    }
+  idx -= PTRS_PER_SECTOR;
+
+  if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+    {
+      block = slot_sector (&disk->doubly_indirect, goal, true, changed);
+      if (block != 0)
+        block = indirect_sector (block, idx / PTRS_PER_SECTOR, goal, true);
+      return (block != 0
+              ? indirect_sector (block, idx % PTRS_PER_SECTOR, goal, meta)
+              : 0);
+    }
+
+  /* Beyond the largest possible file. */
+  return 0;
+}
+
+/* Calls FN for BLOCK, if it is allocated, after calling it for
+   everything BLOCK points to.  LEVEL is 0 for a data sector, 1
+   for an indirect block and 2 for a doubly indirect block.  An
+   index block whose number is beyond the end of the device is
+   passed to FN but not read. */
+static void
+walk_block (block_sector_t block, int level, inode_sector_func *fn,
+            void *aux) 
+{
+  if (block == 0)
+    return;
+
+  if (level > 0 && block < block_size (fs_device))
+    {
+      block_sector_t *ptrs = malloc (BLOCK_SECTOR_SIZE);
+      size_t i;
+
+      /* Without memory we can only skip the sectors below. */
+      if (ptrs != NULL)
+        {
+          cache_read (block, ptrs);
+          for (i = 0; i < PTRS_PER_SECTOR; i++)
+            {
+              /* Read the index blocks below in batches. */
+              if (level > 1 && i % CACHE_PREFETCH_MAX == 0)
+                cache_prefetch (ptrs + i, CACHE_PREFETCH_MAX);
+              walk_block (ptrs[i], level - 1, fn, aux);
+            }
+          free (ptrs);
+        }
+    }
+  fn (block, aux);
+}
+
+/* Calls FN for every data and index sector of DISK. */
+static void
+walk_sectors (const struct inode_disk *disk, inode_sector_func *fn,
+              void *aux) 
+{
+  size_t i;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    walk_block (disk->direct[i], 0, fn, aux);
+  walk_block (disk->indirect, 1, fn, aux);
+  walk_block (disk->doubly_indirect, 2, fn, aux);
+}
+
+/* Releases SECTOR.  An inode_sector_func. */
+static void
+release_sector (block_sector_t sector, void *aux UNUSED) 
+{
+  free_map_release (sector, 1);
+}
+
+/* Releases every data and index sector of DISK. */
+static void
+deallocate (struct inode_disk *disk) 
+{
+  walk_sectors (disk, release_sector, NULL);
+}
+
+/* Calls FN, passing AUX, for every sector that INODE uses for
+   data or index blocks.  Used by the consistency checker.
+   The caller must hold INODE's lock. */
+void
+inode_for_each_sector (struct inode *inode, inode_sector_func *fn,
+                       void *aux) 
+{
+  walk_sectors (&inode->data, fn, aux);
+}
+
+/* Returns true if INODE's on-disk inode carries the inode magic
+   number, false if the sector it was read from does not hold an
+   inode. */
+bool
+inode_is_valid (const struct inode *inode) 
+{
+  return inode->data.magic == INODE_MAGIC;
+}
@@ -5,19 +5,34 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
+struct dir_index;
+
 struct bitmap;
 
 void inode_init (void);
-bool inode_create (block_sector_t, off_t);
+bool inode_create (block_sector_t, off_t, bool is_dir);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+bool inode_is_dir (const struct inode *);
+bool inode_is_removed (const struct inode *);
+bool inode_is_valid (const struct inode *);
+void inode_lock_shared (struct inode *);
+void inode_unlock_shared (struct inode *);
+void inode_lock_exclusive (struct inode *);
+void inode_unlock_exclusive (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+struct dir_index *inode_get_dir_index (const struct inode *);
+void inode_set_dir_index (struct inode *, struct dir_index *);
+
+/* Called for each sector of an inode by inode_for_each_sector(). */
+typedef void inode_sector_func (block_sector_t, void *aux);
+void inode_for_each_sector (struct inode *, inode_sector_func *, void *aux);
 
 #endif /* filesys/inode.h */
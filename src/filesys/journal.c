@@ -0,0 +1,334 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "devices/timer.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Write-ahead journal for file system metadata.
+
+   Every operation that modifies metadata (inodes, index blocks,
+   directories and the free map) runs inside a handle, bracketed
+   by journal_begin() and journal_end().  Metadata sectors
+   written inside a handle are pinned in the buffer cache and
+   added to the running transaction instead of going to disk.
+   All handles that run concurrently join the same transaction,
+   which is committed as a group once no handle is active:
+
+     1. Dirty file data in the buffer cache is written to its
+        home location.
+     2. The image of every sector in the transaction is written
+        to the journal area.
+     3. The journal header is written with the list of home
+        sectors.  This is the commit point.
+     4. Each sector is unpinned and written to its home location.
+     5. The header is rewritten as empty.
+
+   If the system crashes after step 2 and before step 4,
+   journal_recover() copies the images to their home locations
+   at the next boot; before step 2, none of the transaction's
+   metadata has reached its home location, so the disk still
+   holds the previous consistent state.  Either way no full
+   consistency check is needed.
+
+   File data is not journaled, but step 1 writes it before any
+   metadata that points to it can reach the disk, so that a
+   newly allocated sector never shows its previous contents
+   after a crash.  Likewise, sectors freed in a transaction are
+   not allocated again until it commits (see free-map.c), since a
+   crash before then brings back the metadata that uses them.
+
+   A transaction holds at most JOURNAL_BLOCKS sectors.  Each
+   handle reserves HANDLE_CREDITS of them when it begins, and a
+   handle that would not fit waits for the transaction to
+   commit.  Each sector that a handle adds to the transaction
+   uses up one of its credits, so an operation may dirty at most
+   HANDLE_CREDITS distinct metadata sectors; one that may need
+   more, such as writing the whole free map, must be split into
+   several handles.  Because a thread may have to wait
+   in journal_begin() until other handles end, a handle must be
+   begun before taking any inode lock.  Handles nest: only the
+   outermost journal_begin() and journal_end() of a thread
+   count. */
+
+/* Identifies a valid journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* Timer ticks between commits of a transaction that is not
+   full. */
+#define COMMIT_TICKS TIMER_FREQ
+
+/* On-disk journal header.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Committed sectors, 0 if none. */
+    block_sector_t home[JOURNAL_BLOCKS]; /* Home of each image. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 12 - 4 * JOURNAL_BLOCKS];
+  };
+
+/* The running transaction. */
+static block_sector_t txn_sectors[JOURNAL_BLOCKS]; /* Sectors in it. */
+static size_t txn_cnt;                  /* Number of sectors in it. */
+static size_t reserved;                 /* Unused credits of handles. */
+static int active;                      /* Handles running. */
+static bool committing;                 /* Commit in progress? */
+static bool commit_requested;           /* Commit wanted when idle? */
+static uint32_t seq;                    /* Last sequence number used. */
+static bool journal_ready;              /* Set up by journal_init()? */
+
+static struct lock journal_lock;        /* Protects the above. */
+static struct condition txn_open;       /* Signaled when a commit ends. */
+
+static struct journal_header header;    /* Used only by commit. */
+
+/* Copy of the journal area, used only by commit and recovery. */
+static uint8_t images[JOURNAL_BLOCKS][BLOCK_SECTOR_SIZE];
+
+static void commit (void);
+static thread_func journal_thread NO_RETURN;
+
+/* Initializes the journal and starts its commit thread.  Must be
+   called after journal_recover() and, when formatting, after
+   journal_format(). */
+void
+journal_init (void) 
+{
+  lock_init (&journal_lock);
+  lock_stats_register (&journal_lock.stats, "journal");
+  cond_init (&txn_open);
+  txn_cnt = reserved = 0;
+  active = 0;
+  committing = commit_requested = false;
+  journal_ready = true;
+  thread_create ("journal", PRI_DEFAULT, journal_thread, NULL);
+}
+
+/* Writes an empty journal, while formatting the file system. */
+void
+journal_format (void) 
+{
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Replays the committed transaction left in the journal by a
+   crash, if any.  Must be called before anything reads the file
+   system through the buffer cache. */
+void
+journal_recover (void) 
+{
+  size_t cnt, i;
+
+  ASSERT (sizeof header == BLOCK_SECTOR_SIZE);
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    PANIC ("file system has no journal; reformat it");
+  seq = header.seq;
+  if (header.cnt == 0)
+    return;
+
+  printf ("Replaying journal transaction %"PRIu32" (%"PRIu32" sectors)...",
+          header.seq, header.cnt);
+  cnt = header.cnt < JOURNAL_BLOCKS ? header.cnt : JOURNAL_BLOCKS;
+  block_read_multi (fs_device, JOURNAL_SECTOR + 1, cnt, images);
+  for (i = 0; i < cnt; i++) 
+    block_write (fs_device, header.home[i], images[i]);
+  header.cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+  printf ("done.\n");
+}
+
+/* Commits the running transaction, at file system shutdown. */
+void
+journal_done (void) 
+{
+  journal_commit ();
+}
+
+/* Begins a handle for an operation that may modify metadata.
+   Waits if the running transaction might not have room for it. */
+void
+journal_begin (void) 
+{
+  struct thread *cur = thread_current ();
+
+  if (cur->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (committing || commit_requested
+         || txn_cnt + reserved + HANDLE_CREDITS > JOURNAL_BLOCKS)
+    {
+      /* Nobody may be left to commit a full transaction. */
+      if (active == 0 && !committing)
+        commit ();
+      else
+        cond_wait (&txn_open, &journal_lock);
+    }
+  active++;
+  reserved += HANDLE_CREDITS;
+  cur->journal_credits = HANDLE_CREDITS;
+  lock_release (&journal_lock);
+}
+
+/* Ends the running thread's handle.  If it was the last active
+   handle and the transaction is due to commit, commits it. */
+void
+journal_end (void) 
+{
+  struct thread *cur = thread_current ();
+
+  ASSERT (cur->journal_depth > 0);
+  if (--cur->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  active--;
+  reserved -= cur->journal_credits;
+  cur->journal_credits = 0;
+  if (active == 0
+      && (commit_requested || txn_cnt + HANDLE_CREDITS > JOURNAL_BLOCKS))
+    commit ();
+  else if (active == 0)
+    cond_broadcast (&txn_open, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Adds metadata SECTOR, which the caller has just written and
+   pinned in the buffer cache, to the running transaction.  The
+   running thread must be inside a handle, which uses up one of
+   its credits unless SECTOR is already in the transaction. */
+void
+journal_add (block_sector_t sector) 
+{
+  struct thread *cur = thread_current ();
+  size_t i;
+
+  ASSERT (cur->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < txn_cnt; i++)
+    if (txn_sectors[i] == sector)
+      break;
+  if (i == txn_cnt)
+    {
+      if (cur->journal_credits == 0)
+        PANIC ("journal handle dirtied more than %d sectors",
+               HANDLE_CREDITS);
+      ASSERT (txn_cnt < JOURNAL_BLOCKS);
+      cur->journal_credits--;
+      reserved--;
+      txn_sectors[txn_cnt++] = sector;
+    }
+  lock_release (&journal_lock);
+}
+
+/* Returns true if the running thread's handle can still add CNT
+   sectors that are not yet in the transaction. */
+bool
+journal_has_credits (size_t cnt) 
+{
+  struct thread *cur = thread_current ();
+
+  return cur->journal_depth > 0 && (size_t) cur->journal_credits >= cnt;
+}
+
+/* Commits the running transaction, waiting for active handles
+   to end first. */
+void
+journal_commit (void) 
+{
+  if (!journal_ready)
+    return;
+
+  lock_acquire (&journal_lock);
+  commit_requested = true;
+  while (commit_requested)
+    {
+      if (active == 0 && !committing)
+        commit ();
+      else
+        cond_wait (&txn_open, &journal_lock);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Writes the running transaction to the journal and then to its
+   home locations, as described at the top of this file.  The
+   caller must hold journal_lock, which is released during disk
+   I/O, and no handle may be active. */
+static void
+commit (void) 
+{
+  size_t cnt = txn_cnt;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+  ASSERT (active == 0 && !committing);
+
+  commit_requested = false;
+  if (cnt == 0)
+    {
+      cond_broadcast (&txn_open, &journal_lock);
+      return;
+    }
+
+  committing = true;
+  lock_release (&journal_lock);
+
+  /* Write file data first, in case this transaction allocates
+     the sectors it lives in. */
+  cache_flush ();
+
+  /* Write the images, then the header that commits them.  The
+     journal area is contiguous, so the images go out in one
+     multiple-sector write. */
+  for (i = 0; i < cnt; i++)
+    cache_read (txn_sectors[i], images[i]);
+  block_write_multi (fs_device, JOURNAL_SECTOR + 1, cnt, images);
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.seq = seq + 1;
+  header.cnt = cnt;
+  memcpy (header.home, txn_sectors, cnt * sizeof *txn_sectors);
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+
+  /* Checkpoint: write the sectors home, then empty the journal. */
+  for (i = 0; i < cnt; i++)
+    cache_unpin (txn_sectors[i]);
+  header.cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+
+  /* Sectors that the transaction freed may now be reused. */
+  free_map_committed ();
+
+  lock_acquire (&journal_lock);
+  seq++;
+  txn_cnt = 0;
+  committing = false;
+  cond_broadcast (&txn_open, &journal_lock);
+}
+
+/* Journal thread: commits the running transaction periodically,
+   so that metadata changes reach the disk even when the
+   transaction does not fill up.  Also finishes the releases of
+   sectors that handles had no credits left for. */
+static void
+journal_thread (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      timer_sleep (COMMIT_TICKS);
+      free_map_release_deferred ();
+      journal_commit ();
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Journal area on the file system device: a header sector
+   followed by JOURNAL_BLOCKS sectors of block images. */
+#define JOURNAL_SECTOR 2        /* Journal header sector. */
+#define JOURNAL_BLOCKS 32       /* Largest transaction, in sectors. */
+#define JOURNAL_SECTORS (1 + JOURNAL_BLOCKS)
+
+/* Most metadata sectors that one handle may dirty. */
+#define HANDLE_CREDITS 16
+
+void journal_init (void);
+void journal_format (void);
+void journal_recover (void);
+void journal_done (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_add (block_sector_t);
+bool journal_has_credits (size_t);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
@@ -64,6 +64,7 @@ void
 console_init (void) 
 {
   lock_init (&console_lock);
+  lock_stats_register (&console_lock.stats, "console");
   use_console_lock = true;
 }
 
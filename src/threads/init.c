@@ -66,6 +66,7 @@ static void run_actions (char **argv);
 static void usage (void);
 
 #ifdef FILESYS
+static void print_io_stats (char **argv);
 static void locate_block_devices (void);
 static void locate_block_device (enum block_type, const char *name);
 #endif
@@ -256,6 +257,8 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-tickless"))
+        timer_tickless = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -292,6 +295,15 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+#ifdef FILESYS
+/* Prints block device statistics. */
+static void
+print_io_stats (char **argv UNUSED) 
+{
+  block_print_stats ();
+}
+#endif
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -313,8 +325,11 @@ run_actions (char **argv)
       {"ls", 1, fsutil_ls},
       {"cat", 2, fsutil_cat},
       {"rm", 2, fsutil_rm},
+      {"fsck", 1, fsutil_fsck},
+      {"fsck-repair", 1, fsutil_fsck_repair},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"iostat", 1, print_io_stats},
 #endif
       {NULL, 0, NULL},
     };
@@ -361,6 +376,9 @@ usage (void)
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
           "  rm FILE            Delete FILE.\n"
+          "  fsck               Check file system consistency.\n"
+          "  fsck-repair        Check file system and repair free map.\n"
+          "  iostat             Print block device I/O statistics.\n"
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -379,6 +397,7 @@ usage (void)
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -tickless          Stop the periodic timer tick while idle.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
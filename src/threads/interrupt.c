@@ -50,6 +50,7 @@ static bool yield_on_return;    /* Should we yield on interrupt return? */
 /* Programmable Interrupt Controller helpers. */
 static void pic_init (void);
 static void pic_end_of_interrupt (int irq);
+static uint16_t pic_read_irr (void);
 
 /* Interrupt Descriptor Table helpers. */
 static uint64_t make_intr_gate (void (*) (void), int dpl);
@@ -206,6 +207,16 @@ intr_register_int (uint8_t vec_no, int dpl, enum intr_level level,
   register_handler (vec_no, dpl, level, handler, name);
 }
 
+/* Returns true if external interrupt VEC has been raised but
+   not yet delivered, as happens while interrupts are off. */
+bool
+intr_pending (uint8_t vec) 
+{
+  ASSERT (vec >= 0x20 && vec < 0x30);
+
+  return (pic_read_irr () & (1u << (vec - 0x20))) != 0;
+}
+
 /* Returns true during processing of an external interrupt
    and false at all other times. */
 bool
@@ -273,6 +284,17 @@ pic_end_of_interrupt (int irq)
   if (irq >= 0x28)
     outb (0xa0, 0x20);
 }
+
+/* Returns the interrupt request registers of both PICs, the
+   master's in the low byte.  A set bit is an interrupt that has
+   been raised but not yet delivered to the CPU. */
+static uint16_t
+pic_read_irr (void) 
+{
+  outb (PIC0_CTRL, 0x0a);  /* OCW3: read IRR on next read. */
+  outb (PIC1_CTRL, 0x0a);
+  return inb (PIC0_CTRL) | (inb (PIC1_CTRL) << 8);
+}
 
 /* Creates an gate that invokes FUNCTION.
 
@@ -31,6 +31,15 @@
 #include <string.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Locks registered with lock_stats_register(). */
+static struct list stats_list = LIST_INITIALIZER (stats_list);
+
+static int64_t stats_begin_acquire (struct lock_stats *, bool contended);
+static void stats_end_acquire (struct lock_stats *, int64_t start,
+                               bool hold_begins);
+static void stats_release (struct lock_stats *);
 
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
@@ -201,6 +210,7 @@ lock_init (struct lock *lock)
 
   lock->holder = NULL;
   sema_init (&lock->semaphore, 1);
+  memset (&lock->stats, 0, sizeof lock->stats);
 }
 
 /* ADD PRIORITY DONATION: list based function that compares the max priority of two locks */
@@ -230,7 +240,9 @@ lock_acquire (struct lock *lock)
 
   /* MODIFY PRIORITY DONATION: lock acquire */
   enum intr_level old_level;
+  int64_t start;
   old_level = intr_disable ();
+  start = stats_begin_acquire (&lock->stats, lock->holder != NULL);
   if(!thread_mlfqs && lock->holder != NULL)
   {
     struct thread *t = lock->holder;
@@ -241,7 +253,7 @@ lock_acquire (struct lock *lock)
        t = l->holder;
        if( t->priority < p)
        {
-         t->priority = p;
+         thread_change_priority (t, p);
          l->max_priority = p;
        }
        l = t->wait_on_lock;
@@ -255,6 +267,7 @@ lock_acquire (struct lock *lock)
   thread_current()->wait_on_lock = NULL; //and now no more waiting for this lock
   list_insert_ordered(&(thread_current()->locks_held), &lock->elem, lock_pri_cmp,NULL);
   lock->max_priority = thread_get_priority();
+  stats_end_acquire (&lock->stats, start, true);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -273,7 +286,11 @@ lock_try_acquire (struct lock *lock)
 
   success = sema_try_down (&lock->semaphore);
   if (success)
-    lock->holder = thread_current ();
+    {
+      lock->holder = thread_current ();
+      stats_end_acquire (&lock->stats,
+                         stats_begin_acquire (&lock->stats, false), true);
+    }
   return success;
 }
 
@@ -291,6 +308,7 @@ lock_release (struct lock *lock)
   /* MODIFY PRIORITY DONATION: lock release */
   enum intr_level old_level;
   old_level = intr_disable ();
+  stats_release (&lock->stats);
 
   //remove this lock from list of held_locks
   lock->holder = NULL;
@@ -436,3 +454,238 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes spinlock SL. */
+void
+spinlock_init (struct spinlock *sl) 
+{
+  ASSERT (sl != NULL);
+
+  sl->next_ticket = 0;
+  sl->now_serving = 0;
+  memset (&sl->stats, 0, sizeof sl->stats);
+}
+
+/* Acquires SL, spinning until our ticket comes up, and disables
+   interrupts until the matching spinlock_release().  SL must not
+   already be held by the current thread. */
+void
+spinlock_acquire (struct spinlock *sl) 
+{
+  enum intr_level old_level;
+  unsigned ticket = 1;
+  int64_t start;
+
+  ASSERT (sl != NULL);
+
+  old_level = intr_disable ();
+  asm volatile ("lock xaddl %0, %1"
+                : "+r" (ticket), "+m" (sl->next_ticket) : : "memory");
+  start = stats_begin_acquire (&sl->stats, ticket != sl->now_serving);
+  while (*(volatile unsigned *) &sl->now_serving != ticket)
+    asm volatile ("pause" : : : "memory");
+  sl->old_level = old_level;
+  stats_end_acquire (&sl->stats, start, true);
+}
+
+/* Releases SL and restores the interrupt level from before
+   spinlock_acquire(). */
+void
+spinlock_release (struct spinlock *sl) 
+{
+  enum intr_level old_level;
+
+  ASSERT (sl != NULL);
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  old_level = sl->old_level;
+  stats_release (&sl->stats);
+  barrier ();
+  sl->now_serving++;
+  intr_set_level (old_level);
+}
+
+/* Initializes RW.  If PREFER_READERS is true, new readers are
+   admitted whenever no writer holds the lock, even if writers are
+   waiting; this maximizes read concurrency but can starve
+   writers.  Otherwise, waiting writers block new readers. */
+void
+rwlock_init (struct rwlock *rw, bool prefer_readers) 
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->readers_ok);
+  cond_init (&rw->writer_ok);
+  rw->readers = 0;
+  rw->writer = false;
+  rw->waiting_writers = 0;
+  rw->prefer_readers = prefer_readers;
+  memset (&rw->stats, 0, sizeof rw->stats);
+}
+
+/* Acquires RW for reading, sleeping until no writer holds it
+   (and, without reader preference, until no writer waits). */
+void
+rwlock_acquire_read (struct rwlock *rw) 
+{
+  int64_t start;
+
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  start = stats_begin_acquire (&rw->stats, rw->writer
+                               || (!rw->prefer_readers
+                                   && rw->waiting_writers > 0));
+  while (rw->writer || (!rw->prefer_readers && rw->waiting_writers > 0))
+    cond_wait (&rw->readers_ok, &rw->lock);
+  rw->readers++;
+  stats_end_acquire (&rw->stats, start, rw->readers == 1);
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for reading.
+
+   Readers overlap, so the hold time recorded for a read hold
+   runs from the first reader's acquisition to the last reader's
+   release, the span for which writers are shut out. */
+void
+rwlock_release_read (struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->readers > 0);
+  if (--rw->readers == 0)
+    {
+      stats_release (&rw->stats);
+      if (rw->waiting_writers > 0)
+        cond_signal (&rw->writer_ok, &rw->lock);
+    }
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no reader or writer
+   holds it. */
+void
+rwlock_acquire_write (struct rwlock *rw) 
+{
+  int64_t start;
+
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  start = stats_begin_acquire (&rw->stats, rw->writer || rw->readers > 0);
+  rw->waiting_writers++;
+  while (rw->writer || rw->readers > 0)
+    cond_wait (&rw->writer_ok, &rw->lock);
+  rw->waiting_writers--;
+  rw->writer = true;
+  stats_end_acquire (&rw->stats, start, true);
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for writing, and
+   wakes either all waiting readers or one waiting writer,
+   according to RW's preference. */
+void
+rwlock_release_write (struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->writer);
+  stats_release (&rw->stats);
+  rw->writer = false;
+  if (rw->waiting_writers > 0 && !rw->prefer_readers)
+    cond_signal (&rw->writer_ok, &rw->lock);
+  else
+    {
+      cond_broadcast (&rw->readers_ok, &rw->lock);
+      if (rw->waiting_writers > 0)
+        cond_signal (&rw->writer_ok, &rw->lock);
+    }
+  lock_release (&rw->lock);
+}
+
+/* Starts measuring the lock whose statistics are STATS under the
+   name NAME.  The statistics are printed by lock_print_stats(). */
+void
+lock_stats_register (struct lock_stats *stats, const char *name) 
+{
+  enum intr_level old_level;
+
+  ASSERT (stats != NULL);
+  ASSERT (name != NULL);
+  ASSERT (stats->name == NULL);
+
+  old_level = intr_disable ();
+  stats->name = name;
+  list_push_back (&stats_list, &stats->elem);
+  intr_set_level (old_level);
+}
+
+/* Prints the statistics of every registered lock. */
+void
+lock_print_stats (void) 
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&stats_list); e != list_end (&stats_list);
+       e = list_next (e))
+    {
+      struct lock_stats *s = list_entry (e, struct lock_stats, elem);
+      printf ("Lock %s: %lld acquires, %lld contended, "
+              "%lld us waiting, %lld us max hold\n",
+              s->name, s->acquire_cnt, s->contended_cnt,
+              s->wait_ns / 1000, s->max_hold_ns / 1000);
+    }
+}
+
+/* Records the start of an acquisition, which must wait if
+   CONTENDED is true.  Returns the current time if STATS is
+   registered. */
+static int64_t
+stats_begin_acquire (struct lock_stats *stats, bool contended) 
+{
+  if (stats->name == NULL)
+    return 0;
+
+  stats->acquire_cnt++;
+  if (contended)
+    stats->contended_cnt++;
+  return timer_now_ns ();
+}
+
+/* Records the end of an acquisition that began at START.  If
+   HOLD_BEGINS is false, the lock was already held, by another
+   reader, and the hold time keeps running from that earlier
+   acquisition. */
+static void
+stats_end_acquire (struct lock_stats *stats, int64_t start,
+                   bool hold_begins) 
+{
+  int64_t now;
+
+  if (stats->name == NULL)
+    return;
+
+  now = timer_now_ns ();
+  stats->wait_ns += now - start;
+  if (hold_begins)
+    stats->acquired_ns = now;
+}
+
+/* Records a release, updating the longest hold time. */
+static void
+stats_release (struct lock_stats *stats) 
+{
+  int64_t held;
+
+  if (stats->name == NULL)
+    return;
+
+  held = timer_now_ns () - stats->acquired_ns;
+  if (held > stats->max_hold_ns)
+    stats->max_hold_ns = held;
+}
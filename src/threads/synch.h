@@ -3,6 +3,25 @@
 
 #include <list.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "threads/interrupt.h"
+
+/* Contention statistics for a lock.  Only locks registered with
+   lock_stats_register() are measured, so that unnamed locks cost
+   nothing extra to acquire. */
+struct lock_stats
+  {
+    const char *name;           /* Name, or null if not registered. */
+    struct list_elem elem;      /* Element in list of registered locks. */
+    long long acquire_cnt;      /* # of acquisitions. */
+    long long contended_cnt;    /* # of acquisitions that had to wait. */
+    int64_t wait_ns;            /* Total time spent waiting. */
+    int64_t max_hold_ns;        /* Longest time held, by any readers. */
+    int64_t acquired_ns;        /* When last acquired. */
+  };
+
+void lock_stats_register (struct lock_stats *, const char *name);
+void lock_print_stats (void);
 
 /* A counting semaphore. */
 struct semaphore 
@@ -26,6 +45,8 @@ struct lock
     /* ADD PRIORITY DONATION: struct lock */
     struct list_elem elem;      /* list_elem to enable making a list of locks */
     int max_priority;           /* Max priority among all the threads waiting for this lock */
+
+    struct lock_stats stats;    /* Contention statistics. */
   };
 
 void lock_init (struct lock *);
@@ -45,6 +66,42 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Ticket spinlock.  Waiters are served strictly in arrival
+   order.  Interrupts are disabled while the lock is held, so it
+   may be used from interrupt handlers, but it must be held only
+   briefly and never across anything that sleeps. */
+struct spinlock
+  {
+    unsigned next_ticket;       /* Next ticket to hand out. */
+    unsigned now_serving;       /* Ticket that holds the lock. */
+    enum intr_level old_level;  /* Interrupt level to restore on release. */
+    struct lock_stats stats;    /* Contention statistics. */
+  };
+
+void spinlock_init (struct spinlock *);
+void spinlock_acquire (struct spinlock *);
+void spinlock_release (struct spinlock *);
+
+/* Reader-writer lock.  Any number of readers, or a single
+   writer, may hold the lock at once. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers_ok; /* Signaled when readers may enter. */
+    struct condition writer_ok; /* Signaled when a writer may enter. */
+    int readers;                /* # of readers holding the lock. */
+    bool writer;                /* Held by a writer? */
+    int waiting_writers;        /* # of writers waiting. */
+    bool prefer_readers;        /* Admit readers past waiting writers? */
+    struct lock_stats stats;    /* Contention statistics. */
+  };
+
+void rwlock_init (struct rwlock *, bool prefer_readers);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -11,26 +11,50 @@
 #include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 
 #include "threads/fixed-point.h"
 
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
+#ifdef FILESYS
+#include "filesys/directory.h"
+#endif
 
 /* Random value for struct thread's `magic' member.
    Used to detect stack overflow.  See the big comment at the top
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Run queue of processes in THREAD_READY state, that is,
+   processes that are ready to run but not actually running.
+
+   There is one FIFO list per priority level.  Bit P of BITMAP is
+   set if and only if LISTS[P] is nonempty, so the highest
+   priority ready thread is found with a single bit scan instead
+   of walking every ready thread. */
+struct run_queue
+  {
+    struct list lists[PRI_MAX + 1];     /* One list per priority. */
+    uint64_t bitmap;                    /* Nonempty lists. */
+    int size;                           /* Number of threads queued. */
+  };
+
+/* ADD PRIORITY: ready queue, shared by the priority and MLFQS
+   schedulers */
+static struct run_queue ready_queue;
 
-/* ADD MLFQS: 64 ready lists and system wide load avg*/
-static struct list mlfqs_list[64];
+/* ADD MLFQS: system wide load avg */
 static int system_load_avg = 0;
 
+/* ADD MLFQS: threads whose recent_cpu changed since priorities
+   were last recalculated.  Between the once-per-second decays
+   only running threads are charged, so the every-4-ticks pass
+   need not visit every thread. */
+static struct list recent_cpu_changed_list;
+static bool recent_cpu_all_changed;
+
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
 static struct list all_list;
@@ -44,15 +68,6 @@ static struct thread *initial_thread;
 /* Lock used by allocate_tid(). */
 static struct lock tid_lock;
 
-/* ADD PRIORITY: list based function that compares the priority of two threads */
-static bool thread_priority_cmp(const struct list_elem *t1_,
-                             const struct list_elem *t2_, void *aux UNUSED)
-{
-  const struct thread *t1 = list_entry (t1_, struct thread, elem);
-  const struct thread *t2 = list_entry (t2_, struct thread, elem);
-  return t1->priority < t2->priority;
-}
-
 
 
 /* Stack frame for kernel_thread(). */
@@ -68,6 +83,13 @@ static long long idle_ticks;    /* # of timer ticks spent idle. */
 static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
 static long long user_ticks;    /* # of timer ticks in user programs. */
 
+/* Log2 histogram of wakeup-to-run latency, that is, the time
+   from thread_unblock() until the thread is scheduled.  Bucket I
+   counts latencies of [2**I, 2**(I+1)) ns; the last bucket also
+   counts anything longer. */
+#define LATENCY_BUCKETS 32
+static long long wakeup_latency[LATENCY_BUCKETS];
+
 /* Scheduling. */
 #define TIME_SLICE 4            /* # of timer ticks to give each thread. */
 static unsigned thread_ticks;   /* # of timer ticks since last yield. */
@@ -89,6 +111,13 @@ static void schedule (void);
 void thread_schedule_tail (struct thread *prev);
 static tid_t allocate_tid (void);
 
+static void run_queue_init (struct run_queue *);
+static void run_queue_push (struct run_queue *, struct thread *);
+static void run_queue_remove (struct run_queue *, struct thread *);
+static int run_queue_max_priority (const struct run_queue *);
+static struct thread *run_queue_pop (struct run_queue *);
+static int log2_floor (uint64_t);
+
 /* Initializes the threading system by transforming the code
    that's currently running into a thread.  This can't work in
    general and it is possible in this case only because loader.S
@@ -110,15 +139,9 @@ thread_init (void)
   lock_init (&tid_lock);
   list_init (&all_list);
 
-  /* MODIFY MLFQS: initialize 64 ready lists and thread variables */
-  if(!thread_mlfqs)
-    list_init (&ready_list);
-  else
-  {
-    int i;
-    for(i=0;i<64;i++)
-      list_init (&mlfqs_list[i]);
-  }
+  /* MODIFY MLFQS: initialize ready queue and thread variables */
+  run_queue_init (&ready_queue);
+  list_init (&recent_cpu_changed_list);
   init_f_value(); //initialize floating point arithmatic
   initial_thread->nice = 0; //nice value of first thread is zero
   initial_thread->recent_cpu = 0; //recent_cpu of first thread is zero
@@ -174,8 +197,30 @@ thread_tick (void)
 void
 thread_print_stats (void) 
 {
+  struct list_elem *e;
+  int i;
+
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
           idle_ticks, kernel_ticks, user_ticks);
+
+  for (e = list_begin (&all_list); e != list_end (&all_list);
+       e = list_next (e))
+    {
+      struct thread *t = list_entry (e, struct thread, allelem);
+      printf ("Thread %s: %lld us running, %lld us ready, "
+              "%u voluntary and %u involuntary switches\n",
+              t->name, t->cpu_ns / 1000, t->ready_ns / 1000,
+              t->voluntary_switches, t->involuntary_switches);
+    }
+
+  lock_print_stats ();
+
+  printf ("Wakeup latency (ns):");
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    if (wakeup_latency[i] != 0)
+      printf (" %s%llu:%lld", i == LATENCY_BUCKETS - 1 ? ">=" : "",
+              1ULL << i, wakeup_latency[i]);
+  printf ("\n");
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -219,6 +264,12 @@ thread_create (const char *name, int priority,
   init_thread (t, name, priority);
   tid = t->tid = allocate_tid ();
 
+#ifdef FILESYS
+  /* Inherit the working directory. */
+  if (thread_current ()->cwd != NULL)
+    t->cwd = dir_reopen (thread_current ()->cwd);
+#endif
+
   /* Prepare thread for first run by initializing its stack.
      Do this atomically so intermediate values for the 'stack' 
      member cannot be observed. */
@@ -284,10 +335,9 @@ thread_unblock (struct thread *t)
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
 
-  if(!thread_mlfqs)
-    list_push_back (&ready_list, &t->elem);
-  else
-    list_push_back (&mlfqs_list[t->priority], &t->elem);
+  t->ready_since_ns = timer_now_ns ();
+  t->woken = true;
+  run_queue_push (&ready_queue, t);
 
   t->status = THREAD_READY;
   intr_set_level (old_level);
@@ -342,12 +392,17 @@ thread_exit (void)
 #ifdef USERPROG
   process_exit ();
 #endif
+#ifdef FILESYS
+  dir_close (thread_current ()->cwd);
+#endif
 
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
      when it calls thread_schedule_tail(). */
   intr_disable ();
   list_remove (&thread_current()->allelem);
+  if (thread_current ()->recent_cpu_changed)
+    list_remove (&thread_current ()->cpuelem);
   thread_current ()->status = THREAD_DYING;
   schedule ();
   NOT_REACHED ();
@@ -367,10 +422,9 @@ thread_yield (void)
 
   if (cur != idle_thread) 
   {
-    if(!thread_mlfqs)
-      list_push_back (&ready_list, &cur->elem);
-    else
-      list_push_back (&mlfqs_list[cur->priority], &cur->elem);
+    cur->ready_since_ns = timer_now_ns ();
+    cur->woken = false;
+    run_queue_push (&ready_queue, cur);
   }
 
   cur->status = THREAD_READY;
@@ -395,6 +449,41 @@ thread_foreach (thread_action_func *func, void *aux)
     }
 }
 
+/* Returns the CPU time used so far by the running thread, in
+   nanoseconds. */
+int64_t
+thread_get_cpu_ns (void) 
+{
+  enum intr_level old_level = intr_disable ();
+  struct thread *cur = thread_current ();
+  int64_t ns = cur->cpu_ns + (timer_now_ns () - cur->run_start_ns);
+  intr_set_level (old_level);
+  return ns;
+}
+
+/* Sets the effective priority of T to PRIORITY, e.g. because of
+   priority donation.  If T is in the ready queue, it is moved to
+   the queue for its new priority.  Interrupts must be off. */
+void
+thread_change_priority (struct thread *t, int priority)
+{
+  ASSERT (is_thread (t));
+  ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (t->priority == priority)
+    return;
+
+  if (t->status == THREAD_READY)
+    {
+      run_queue_remove (&ready_queue, t);
+      t->priority = priority;
+      run_queue_push (&ready_queue, t);
+    }
+  else
+    t->priority = priority;
+}
+
 /* Sets the current thread's priority to NEW_PRIORITY. */
 void
 thread_set_priority (int new_priority) 
@@ -432,7 +521,7 @@ thread_set_priority (int new_priority)
     intr_set_level (old_level);
 
     //yield if there exists a higher priority thread in ready list
-    t = list_entry(list_max (&ready_list,thread_priority_cmp,NULL),struct thread,elem)->priority;
+    t = run_queue_max_priority (&ready_queue);
     if(t > thread_current ()->priority)
       thread_yield();
   }
@@ -467,10 +556,7 @@ thread_set_nice (int nice)
     cur->priority = PRI_MIN;
 
   //yield if higher priority thread is waiting in ready lists
-  int i = 63;
-  while(i>=0 && list_empty(&mlfqs_list[i]))
-    i--;
-  if(cur->priority < i)
+  if(cur->priority < run_queue_max_priority (&ready_queue))
     thread_yield();
 }
 
@@ -511,35 +597,71 @@ void calculate_recent_cpu(struct thread *t, void *aux UNUSED)
   t->recent_cpu = add_fixed_and_integer(j,t->nice);  
 }
 
+/* ADD MLFQS: charges the current timer tick to T's recent_cpu and
+   remembers T for the next priority recalculation.  Called from
+   the timer interrupt handler. */
+void thread_mlfqs_charge_tick(struct thread *t)
+{
+  t->recent_cpu = add_fixed_and_integer(t->recent_cpu,1);
+  if(!t->recent_cpu_changed)
+  {
+    t->recent_cpu_changed = true;
+    list_push_back (&recent_cpu_changed_list, &t->cpuelem);
+  }
+}
+
+/* ADD MLFQS: recalculates recent_cpu of every thread.  Called from
+   the timer interrupt handler once per second. */
+void thread_mlfqs_decay_recent_cpu(void)
+{
+  thread_foreach (calculate_recent_cpu, 0);
+  recent_cpu_all_changed = true;
+}
+
+/* ADD MLFQS: recalculates the priority of each thread whose
+   recent_cpu changed since the last call.  Called from the timer
+   interrupt handler every 4th tick. */
+void thread_mlfqs_update_priorities(void)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if(recent_cpu_all_changed)
+  {
+    thread_foreach (calculate_priority, 0);
+    list_init (&recent_cpu_changed_list);
+    recent_cpu_all_changed = false;
+  }
+  else
+  {
+    while(!list_empty (&recent_cpu_changed_list))
+    {
+      struct list_elem *e = list_pop_front (&recent_cpu_changed_list);
+      calculate_priority (list_entry (e, struct thread, cpuelem), 0);
+    }
+  }
+}
+
 /* MODIFY MLFQS: function to calculate priority */
 void calculate_priority(struct thread *t, void *aux UNUSED)
 {
-  int old_p = t->priority;
-  t->priority = PRI_MAX - covert_to_integer_round(t->recent_cpu / 4) - (t->nice * 2);
+  int p = PRI_MAX - covert_to_integer_round(t->recent_cpu / 4) - (t->nice * 2);
   
-  if(t->priority > PRI_MAX)
-    t->priority = PRI_MAX;
+  if(p > PRI_MAX)
+    p = PRI_MAX;
 
-  if(t->priority < PRI_MIN)
-    t->priority = PRI_MIN;
+  if(p < PRI_MIN)
+    p = PRI_MIN;
 
-  if(old_p != t->priority && t->status == THREAD_READY)
-  { 
-     list_remove(&t->elem);
-     list_push_back (&mlfqs_list[t->priority], &t->elem);
-  }
-  
+  //only requeues T if its priority actually changed
+  thread_change_priority (t, p);
+  t->recent_cpu_changed = false;
 }
 
 /* MODIFY MLFQS: function to get ready threads */
 int get_ready_threads(void)
 {
-  int i,ready_threads = 0;
+  int ready_threads = ready_queue.size;
 
-  for(i=0;i<64;i++)
-  {
-     ready_threads += list_size(&mlfqs_list[i]);
-  } 
   if(running_thread () != idle_thread)
      ready_threads += 1;
 
@@ -585,6 +707,9 @@ idle (void *idle_started_ UNUSED)
       intr_disable ();
       thread_block ();
 
+      /* In tickless mode, stop the periodic timer tick. */
+      timer_idle_enter ();
+
       /* Re-enable interrupts and wait for the next one.
 
          The `sti' instruction disables interrupts until the
@@ -670,6 +795,13 @@ init_thread (struct thread *t, const char *name, int priority)
 
   list_init (&t->locks_held);
   t->wait_on_lock = NULL;
+
+#ifdef USERPROG
+  t->exit_status = -1;
+  list_init (&t->children);
+  list_init (&t->fds);
+  t->next_fd = 2;
+#endif
 }
 
 /* Allocates a SIZE-byte frame at the top of thread T's stack and
@@ -693,28 +825,9 @@ alloc_frame (struct thread *t, size_t size)
 static struct thread *
 next_thread_to_run (void) 
 {
-  if(!thread_mlfqs)
-  {
-    if (list_empty (&ready_list))
-      return idle_thread;
-    else
-    {
-      /* MODIFY PRIORITY: choose highest priority thread to run from ready list */
-      struct list_elem *e = list_max (&ready_list,thread_priority_cmp,NULL);
-      list_remove(e);
-      return list_entry(e,struct thread,elem);
-    }
-  }
-  else
-  {
-    int i=63;
-    while(i>=0 && list_empty(&mlfqs_list[i]))
-      i--;
-    if(i>=0)
-      return list_entry(list_pop_front (&mlfqs_list[i]), struct thread, elem);
-    else
-      return idle_thread;
-  }
+  /* MODIFY PRIORITY: choose highest priority thread to run from ready queue */
+  struct thread *t = run_queue_pop (&ready_queue);
+  return t != NULL ? t : idle_thread;
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -776,16 +889,119 @@ schedule (void)
   struct thread *cur = running_thread ();
   struct thread *next = next_thread_to_run ();
   struct thread *prev = NULL;
+  int64_t now;
 
   ASSERT (intr_get_level () == INTR_OFF);
   ASSERT (cur->status != THREAD_RUNNING);
   ASSERT (is_thread (next));
 
+  /* Charge CUR for the time it has been running. */
+  now = timer_now_ns ();
+  cur->cpu_ns += now - cur->run_start_ns;
+  next->run_start_ns = now;
+
+  if (cur != next)
+    {
+      if (cur->status == THREAD_READY)
+        cur->involuntary_switches++;
+      else
+        cur->voluntary_switches++;
+    }
+
+  /* Charge NEXT for the time it waited in the ready queue. */
+  if (next != idle_thread)
+    {
+      int64_t latency = now - next->ready_since_ns;
+      next->ready_ns += latency;
+      if (next->woken)
+        {
+          int bucket = latency > 0 ? log2_floor (latency) : 0;
+          if (bucket >= LATENCY_BUCKETS)
+            bucket = LATENCY_BUCKETS - 1;
+          wakeup_latency[bucket]++;
+        }
+    }
+
+  /* Leaving the idle thread: bring back the periodic tick. */
+  if (cur == idle_thread && next != idle_thread)
+    timer_idle_exit ();
+
   if (cur != next)
     prev = switch_threads (cur, next);
   thread_schedule_tail (prev);
 }
 
+/* Initializes RQ as an empty run queue. */
+static void
+run_queue_init (struct run_queue *rq)
+{
+  int i;
+
+  for (i = PRI_MIN; i <= PRI_MAX; i++)
+    list_init (&rq->lists[i]);
+  rq->bitmap = 0;
+  rq->size = 0;
+}
+
+/* Appends T to the back of RQ's list for T's priority. */
+static void
+run_queue_push (struct run_queue *rq, struct thread *t)
+{
+  list_push_back (&rq->lists[t->priority], &t->elem);
+  rq->bitmap |= (uint64_t) 1 << t->priority;
+  rq->size++;
+}
+
+/* Removes T from RQ.  T's priority must not have changed since T
+   was pushed. */
+static void
+run_queue_remove (struct run_queue *rq, struct thread *t)
+{
+  list_remove (&t->elem);
+  if (list_empty (&rq->lists[t->priority]))
+    rq->bitmap &= ~((uint64_t) 1 << t->priority);
+  rq->size--;
+}
+
+/* Returns the highest priority of any thread in RQ, or -1 if RQ
+   is empty. */
+static int
+run_queue_max_priority (const struct run_queue *rq)
+{
+  return rq->bitmap != 0 ? log2_floor (rq->bitmap) : -1;
+}
+
+/* Removes and returns the first thread of the highest priority
+   in RQ, or a null pointer if RQ is empty. */
+static struct thread *
+run_queue_pop (struct run_queue *rq)
+{
+  int pri = run_queue_max_priority (rq);
+  struct thread *t;
+
+  if (pri < 0)
+    return NULL;
+
+  t = list_entry (list_pop_front (&rq->lists[pri]), struct thread, elem);
+  if (list_empty (&rq->lists[pri]))
+    rq->bitmap &= ~((uint64_t) 1 << pri);
+  rq->size--;
+  return t;
+}
+
+/* Returns the index of the most significant set bit in X, which
+   must be nonzero. */
+static int
+log2_floor (uint64_t x) 
+{
+  uint32_t hi = x >> 32;
+  uint32_t lo = x;
+
+  /* __builtin_clz() compiles to a single BSR instruction. */
+  ASSERT (x != 0);
+  return hi != 0 ? 63 - __builtin_clz (hi) : 31 - __builtin_clz (lo);
+}
+
 /* Returns a tid to use for a new thread. */
 static tid_t
 allocate_tid (void) 
@@ -96,6 +96,22 @@ struct thread
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
+    int exit_status;                    /* Status to report at exit. */
+    struct child *child;                /* Exit status shared with parent. */
+    struct list children;               /* Children's exit statuses. */
+    struct file *executable;            /* Running executable. */
+
+    /* Owned by userprog/syscall.c. */
+    struct list fds;                    /* Open file descriptors. */
+    int next_fd;                        /* Next file descriptor number. */
+    bool user_access;                   /* In a user memory accessor. */
+#endif
+
+#ifdef FILESYS
+    /* Owned by filesys/directory.c. */
+    struct dir *cwd;                    /* Working directory, null for root. */
+    int journal_depth;                  /* Nesting of journal handles. */
+    int journal_credits;                /* Credits left in outermost handle. */
 #endif
 
     /* Owned by thread.c. */
@@ -110,6 +126,25 @@ struct thread
     /* ADD MLFQS: struct thread */
     int nice;
     int recent_cpu;
+    bool recent_cpu_changed;            /* On recent_cpu_changed_list? */
+    struct list_elem cpuelem;           /* recent_cpu_changed_list element. */
+
+    /* ADD ALARM: sleep bookkeeping, owned by devices/timer.c */
+    int64_t wakeup_time;                /* Tick at which to wake up. */
+    unsigned sleep_seq;                 /* Tie breaker for equal wakeup_time. */
+    struct thread *sleep_child;         /* First child in sleep heap. */
+    struct thread *sleep_sibling;       /* Next sibling in sleep heap. */
+
+    /* CPU time accounting, from timer_now_ns(). */
+    int64_t cpu_ns;                     /* Time spent running. */
+    int64_t run_start_ns;               /* When last scheduled in. */
+
+    /* Scheduler statistics, printed by thread_print_stats(). */
+    unsigned voluntary_switches;        /* Switched out by blocking. */
+    unsigned involuntary_switches;      /* Switched out while ready. */
+    int64_t ready_ns;                   /* Time spent in the ready queue. */
+    int64_t ready_since_ns;             /* When last made ready. */
+    bool woken;                         /* Made ready by thread_unblock()? */
   };
 
 /* If false (default), use round-robin scheduler.
@@ -140,8 +175,11 @@ void thread_yield (void);
 typedef void thread_action_func (struct thread *t, void *aux);
 void thread_foreach (thread_action_func *, void *);
 
+int64_t thread_get_cpu_ns (void);
+
 int thread_get_priority (void);
 void thread_set_priority (int);
+void thread_change_priority (struct thread *, int);
 
 int thread_get_nice (void);
 void thread_set_nice (int);
@@ -151,6 +189,9 @@ int thread_get_load_avg (void);
 /* ADD MLFQ: function decralations */
 void calculate_recent_cpu(struct thread *t, void *aux UNUSED);
 void calculate_priority(struct thread *t, void *aux UNUSED);
+void thread_mlfqs_charge_tick(struct thread *t);
+void thread_mlfqs_decay_recent_cpu(void);
+void thread_mlfqs_update_priorities(void);
 int get_ready_threads(void);
 int get_system_load_avg(void);
 void set_system_load_avg(int load);
@@ -4,6 +4,7 @@
 #include "userprog/gdt.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -148,6 +149,19 @@ page_fault (struct intr_frame *f)
   write = (f->error_code & PF_W) != 0;
   user = (f->error_code & PF_U) != 0;
 
+  /* A fault by the kernel on a user address, while the thread is
+     in one of the user memory accessors in syscall.c, means the
+     user passed a bad pointer.  The accessor has put the address
+     to resume at in %eax.  Resume there, with %eax set to -1 to
+     report the fault. */
+  if (!user && is_user_vaddr (fault_addr)
+      && thread_current ()->user_access)
+    {
+      f->eip = (void (*) (void)) f->eax;
+      f->eax = 0xffffffff;
+      return;
+    }
+
   /* To implement virtual memory, delete the rest of the function
      body, and replace it with code that brings in the page to
      which fault_addr refers. */
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "userprog/gdt.h"
 #include "userprog/pagedir.h"
+#include "userprog/syscall.h"
 #include "userprog/tss.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
@@ -14,55 +15,120 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 
-static thread_func start_process NO_RETURN;
-static bool load (const char *cmdline, void (**eip) (void), void **esp);
+/* A child process's exit status.  Shared between the child and
+   its parent, so that it outlives whichever of them exits
+   first. */
+struct child
+  {
+    struct list_elem elem;      /* Element in parent's children list. */
+    tid_t tid;                  /* Child's thread identifier. */
+    int exit_status;            /* Set when the child exits. */
+    struct semaphore exited;    /* Up'd when the child exits. */
+    int ref_cnt;                /* Number of live parent and child, 0-2. */
+  };
+
+/* Passed from process_execute() to start_process(). */
+struct exec_info
+  {
+    char *cmd_line;             /* Command line, in its own page. */
+    struct child *child;        /* The new process's exit status. */
+    struct semaphore loaded;    /* Up'd when loading is done. */
+    bool success;               /* Did the program load? */
+  };
 
-/* Starts a new thread running a user program loaded from
-   FILENAME.  The new thread may be scheduled (and may even exit)
-   before process_execute() returns.  Returns the new process's
-   thread id, or TID_ERROR if the thread cannot be created. */
+static thread_func start_process NO_RETURN;
+static bool load (const char *cmd_line, void (**eip) (void), void **esp);
+static void release_child (struct child *);
+
+/* Starts a new thread running a user program loaded from the
+   first word of CMD_LINE, passing it the words of CMD_LINE as
+   its arguments.  Waits until the program has been loaded.
+   Returns the new process's thread id, or TID_ERROR if the
+   thread cannot be created or the program cannot be loaded. */
 tid_t
-process_execute (const char *file_name) 
+process_execute (const char *cmd_line) 
 {
-  char *fn_copy;
+  struct exec_info info;
+  char name[sizeof thread_current ()->name];
+  const char *prog;
+  size_t prog_len;
   tid_t tid;
 
-  /* Make a copy of FILE_NAME.
+  /* Make a copy of CMD_LINE.
      Otherwise there's a race between the caller and load(). */
-  fn_copy = palloc_get_page (0);
-  if (fn_copy == NULL)
+  info.cmd_line = palloc_get_page (0);
+  if (info.cmd_line == NULL)
     return TID_ERROR;
-  strlcpy (fn_copy, file_name, PGSIZE);
+  strlcpy (info.cmd_line, cmd_line, PGSIZE);
 
-  /* Create a new thread to execute FILE_NAME. */
-  tid = thread_create (file_name, PRI_DEFAULT, start_process, fn_copy);
+  info.child = malloc (sizeof *info.child);
+  if (info.child == NULL)
+    {
+      palloc_free_page (info.cmd_line);
+      return TID_ERROR;
+    }
+  info.child->exit_status = -1;
+  sema_init (&info.child->exited, 0);
+  info.child->ref_cnt = 2;
+  sema_init (&info.loaded, 0);
+
+  /* Name the thread after the program. */
+  prog = cmd_line + strspn (cmd_line, " ");
+  prog_len = strcspn (prog, " ");
+  strlcpy (name, prog, prog_len + 1 < sizeof name ? prog_len + 1 : sizeof name);
+
+  /* Create a new thread to execute CMD_LINE, and wait for it to
+     load its program.  The child frees the command line page. */
+  tid = thread_create (name, PRI_DEFAULT, start_process, &info);
   if (tid == TID_ERROR)
-    palloc_free_page (fn_copy); 
+    {
+      palloc_free_page (info.cmd_line);
+      free (info.child);
+      return TID_ERROR;
+    }
+  sema_down (&info.loaded);
+  if (!info.success)
+    {
+      release_child (info.child);
+      return TID_ERROR;
+    }
+  list_push_back (&thread_current ()->children, &info.child->elem);
   return tid;
 }
 
 /* A thread function that loads a user process and starts it
    running. */
 static void
-start_process (void *file_name_)
+start_process (void *info_)
 {
-  char *file_name = file_name_;
+  struct exec_info *info = info_;
+  struct thread *cur = thread_current ();
   struct intr_frame if_;
   bool success;
 
+  cur->child = info->child;
+  cur->child->tid = cur->tid;
+
   /* Initialize interrupt frame and load executable. */
   memset (&if_, 0, sizeof if_);
   if_.gs = if_.fs = if_.es = if_.ds = if_.ss = SEL_UDSEG;
   if_.cs = SEL_UCSEG;
   if_.eflags = FLAG_IF | FLAG_MBS;
-  success = load (file_name, &if_.eip, &if_.esp);
+  success = load (info->cmd_line, &if_.eip, &if_.esp);
+
+  /* Tell the parent how loading went.  INFO is on the parent's
+     stack, so it may not be touched after that. */
+  palloc_free_page (info->cmd_line);
+  info->success = success;
+  sema_up (&info->loaded);
 
   /* If load failed, quit. */
-  palloc_free_page (file_name);
   if (!success) 
     thread_exit ();
 
@@ -83,14 +149,48 @@ start_process (void *file_name_)
    been successfully called for the given TID, returns -1
    immediately, without waiting.
 
-   This function will be implemented in problem 2-2.  For now, it
-   does nothing. */
+   Only a thread's children, created by process_execute(), can
+   be waited for. */
 int
-process_wait (tid_t child_tid UNUSED) 
+process_wait (tid_t child_tid) 
 {
+  struct thread *cur = thread_current ();
+  struct list_elem *e;
+
+  for (e = list_begin (&cur->children); e != list_end (&cur->children);
+       e = list_next (e))
+    {
+      struct child *c = list_entry (e, struct child, elem);
+      if (c->tid == child_tid)
+        {
+          int exit_status;
+
+          list_remove (e);
+          sema_down (&c->exited);
+          exit_status = c->exit_status;
+          release_child (c);
+          return exit_status;
+        }
+    }
   return -1;
 }
 
+/* Drops a reference to child record C, freeing it when neither
+   the parent nor the child refers to it any longer. */
+static void
+release_child (struct child *c) 
+{
+  enum intr_level old_level;
+  int ref_cnt;
+
+  old_level = intr_disable ();
+  ref_cnt = --c->ref_cnt;
+  intr_set_level (old_level);
+
+  if (ref_cnt == 0)
+    free (c);
+}
+
 /* Free the current process's resources. */
 void
 process_exit (void)
@@ -98,6 +198,29 @@ process_exit (void)
   struct thread *cur = thread_current ();
   uint32_t *pd;
 
+  /* A user process reports its exit status. */
+  if (cur->pagedir != NULL)
+    printf ("%s: exit(%d)\n", cur->name, cur->exit_status);
+
+  /* Close open files, including the executable, which allows
+     writes to it again. */
+  syscall_exit ();
+  file_close (cur->executable);
+  cur->executable = NULL;
+
+  /* Hand our exit status to our parent, and let go of our
+     children's. */
+  if (cur->child != NULL)
+    {
+      cur->child->exit_status = cur->exit_status;
+      sema_up (&cur->child->exited);
+      release_child (cur->child);
+      cur->child = NULL;
+    }
+  while (!list_empty (&cur->children))
+    release_child (list_entry (list_pop_front (&cur->children),
+                               struct child, elem));
+
   /* Destroy the current process's page directory and switch back
      to the kernel-only page directory. */
   pd = cur->pagedir;
@@ -116,6 +239,31 @@ process_exit (void)
     }
 }
 
+/* Adds 1 to *CNT if T is running a user process.  A
+   thread_action_func. */
+static void
+count_process (struct thread *t, void *cnt_) 
+{
+  size_t *cnt = cnt_;
+
+  if (t->pagedir != NULL)
+    (*cnt)++;
+}
+
+/* Returns the number of user processes that have not yet torn
+   down their address spaces. */
+size_t
+process_count (void) 
+{
+  enum intr_level old_level;
+  size_t cnt = 0;
+
+  old_level = intr_disable ();
+  thread_foreach (count_process, &cnt);
+  intr_set_level (old_level);
+  return cnt;
+}
+
 /* Sets up the CPU for running user code in the current
    thread.
    This function is called on every context switch. */
@@ -195,22 +343,26 @@ struct Elf32_Phdr
 #define PF_W 2          /* Writable. */
 #define PF_R 4          /* Readable. */
 
-static bool setup_stack (void **esp);
+static bool setup_stack (const char *cmd_line, void **esp);
 static bool validate_segment (const struct Elf32_Phdr *, struct file *);
 static bool load_segment (struct file *file, off_t ofs, uint8_t *upage,
                           uint32_t read_bytes, uint32_t zero_bytes,
                           bool writable);
 
-/* Loads an ELF executable from FILE_NAME into the current thread.
+/* Loads an ELF executable, named by the first word of CMD_LINE,
+   into the current thread, and sets up its stack with the words
+   of CMD_LINE as arguments.
    Stores the executable's entry point into *EIP
    and its initial stack pointer into *ESP.
    Returns true if successful, false otherwise. */
 bool
-load (const char *file_name, void (**eip) (void), void **esp) 
+load (const char *cmd_line, void (**eip) (void), void **esp) 
 {
   struct thread *t = thread_current ();
   struct Elf32_Ehdr ehdr;
   struct file *file = NULL;
+  char *file_name = NULL;
+  size_t name_len;
   off_t file_ofs;
   bool success = false;
   int i;
@@ -221,6 +373,14 @@ load (const char *file_name, void (**eip) (void), void **esp)
     goto done;
   process_activate ();
 
+  /* Extract the program name. */
+  cmd_line += strspn (cmd_line, " ");
+  name_len = strcspn (cmd_line, " ");
+  file_name = malloc (name_len + 1);
+  if (file_name == NULL)
+    goto done;
+  strlcpy (file_name, cmd_line, name_len + 1);
+
   /* Open executable file. */
   file = filesys_open (file_name);
   if (file == NULL) 
@@ -302,17 +462,22 @@ load (const char *file_name, void (**eip) (void), void **esp)
     }
 
   /* Set up stack. */
-  if (!setup_stack (esp))
+  if (!setup_stack (cmd_line, esp))
     goto done;
 
   /* Start address. */
   *eip = (void (*) (void)) ehdr.e_entry;
 
+  /* Keep the executable open, and unwritable, while it runs. */
+  file_deny_write (file);
+  t->executable = file;
   success = true;
 
  done:
   /* We arrive here whether the load is successful or not. */
-  file_close (file);
+  if (!success)
+    file_close (file);
+  free (file_name);
   return success;
 }
 
@@ -424,21 +589,89 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   return true;
 }
 
+/* Pushes the SIZE bytes at DATA onto the stack being built in
+   KPAGE, whose top is at offset *OFS, keeping the stack pointer
+   aligned to 4 bytes.  Returns the kernel address of the copy,
+   or a null pointer if the page is full. */
+static void *
+push (uint8_t *kpage, size_t *ofs, const void *data, size_t size) 
+{
+  size_t padded = ROUND_UP (size, sizeof (uint32_t));
+
+  if (*ofs < padded)
+    return NULL;
+  *ofs -= padded;
+  memcpy (kpage + *ofs, data, size);
+  return kpage + *ofs;
+}
+
+/* Lays out the arguments for main() on the stack being built in
+   KPAGE, which will be mapped at user address UPAGE: the words
+   of CMD_LINE, a null-terminated argv[] pointing to them, argv,
+   argc and a fake return address.  Stores the initial user stack
+   pointer into *ESP.  Returns false if the arguments do not fit
+   in the page. */
+static bool
+push_arguments (uint8_t *kpage, uint8_t *upage, const char *cmd_line,
+                void **esp) 
+{
+  size_t ofs = PGSIZE;
+  char *words, *word, *save_ptr;
+  char **kargv;
+  void *null = NULL;
+  char **argv;
+  int argc, i;
+
+  /* Copy the command line to the top of the stack, and break it
+     into words in place. */
+  words = push (kpage, &ofs, cmd_line, strlen (cmd_line) + 1);
+  if (words == NULL || push (kpage, &ofs, &null, sizeof null) == NULL)
+    return false;
+
+  /* Push the user address of each word, giving argv[] in reverse
+     order, then put it in order. */
+  argc = 0;
+  for (word = strtok_r (words, " ", &save_ptr); word != NULL;
+       word = strtok_r (NULL, " ", &save_ptr))
+    {
+      void *uword = upage + (word - (char *) kpage);
+      if (push (kpage, &ofs, &uword, sizeof uword) == NULL)
+        return false;
+      argc++;
+    }
+  kargv = (char **) (kpage + ofs);
+  for (i = 0; i < argc / 2; i++)
+    {
+      char *tmp = kargv[i];
+      kargv[i] = kargv[argc - 1 - i];
+      kargv[argc - 1 - i] = tmp;
+    }
+  argv = (char **) (upage + ofs);
+
+  if (push (kpage, &ofs, &argv, sizeof argv) == NULL
+      || push (kpage, &ofs, &argc, sizeof argc) == NULL
+      || push (kpage, &ofs, &null, sizeof null) == NULL)
+    return false;
+
+  *esp = upage + ofs;
+  return true;
+}
+
 /* Create a minimal stack by mapping a zeroed page at the top of
-   user virtual memory. */
+   user virtual memory, holding the arguments in CMD_LINE. */
 static bool
-setup_stack (void **esp) 
+setup_stack (const char *cmd_line, void **esp) 
 {
   uint8_t *kpage;
+  uint8_t *upage = ((uint8_t *) PHYS_BASE) - PGSIZE;
   bool success = false;
 
   kpage = palloc_get_page (PAL_USER | PAL_ZERO);
   if (kpage != NULL) 
     {
-      success = install_page (((uint8_t *) PHYS_BASE) - PGSIZE, kpage, true);
-      if (success)
-        *esp = PHYS_BASE;
-      else
+      success = (push_arguments (kpage, upage, cmd_line, esp)
+                 && install_page (upage, kpage, true));
+      if (!success)
         palloc_free_page (kpage);
     }
   return success;
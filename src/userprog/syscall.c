@@ -1,10 +1,102 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
+#include "devices/input.h"
+#include "devices/shutdown.h"
+#include "filesys/directory.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+#include "userprog/process.h"
+
+/* An open file descriptor. */
+struct fd
+  {
+    struct list_elem elem;      /* Element in the thread's fds list. */
+    int fd;                     /* File descriptor number. */
+    struct file *file;          /* Open file. */
+    struct dir *dir;            /* Open directory, if FILE is one. */
+  };
+
+/* Longest file name that readdir() returns, from
+   lib/user/syscall.h. */
+#define READDIR_MAX_LEN 14
 
 static void syscall_handler (struct intr_frame *);
+static void kill_process (void) NO_RETURN;
+
+static int sys_halt (void) NO_RETURN;
+static int sys_exit (int status) NO_RETURN;
+static int sys_exec (const char *ucmd_line);
+static int sys_wait (tid_t);
+static int sys_create (const char *ufile, unsigned initial_size);
+static int sys_remove (const char *ufile);
+static int sys_open (const char *ufile);
+static int sys_filesize (int fd);
+static int sys_read (int fd, void *ubuf, unsigned size);
+static int sys_write (int fd, const void *ubuf, unsigned size);
+static int sys_seek (int fd, unsigned position);
+static int sys_tell (int fd);
+static int sys_close (int fd);
+static int sys_mmap (int fd, void *addr);
+static int sys_munmap (int mapping);
+static int sys_chdir (const char *udir);
+static int sys_mkdir (const char *udir);
+static int sys_readdir (int fd, char *uname);
+static int sys_isdir (int fd);
+static int sys_inumber (int fd);
+
+/* A system call handler.  Every handler takes its arguments as
+   up to three 32-bit words, and its return value is stored in
+   the caller's %eax.  The handlers are declared with their real
+   parameter types, so the table stores them as generic function
+   pointers and the dispatcher converts back to this type to
+   call them. */
+typedef int syscall_function (int, int, int);
+typedef void generic_function (void);
+
+/* A system call. */
+struct syscall
+  {
+    size_t arg_cnt;             /* Number of arguments. */
+    generic_function *func;     /* Implementation. */
+  };
+
+/* Table of system calls, indexed by system call number. */
+static const struct syscall syscall_table[] =
+  {
+    [SYS_HALT] = {0, (generic_function *) sys_halt},
+    [SYS_EXIT] = {1, (generic_function *) sys_exit},
+    [SYS_EXEC] = {1, (generic_function *) sys_exec},
+    [SYS_WAIT] = {1, (generic_function *) sys_wait},
+    [SYS_CREATE] = {2, (generic_function *) sys_create},
+    [SYS_REMOVE] = {1, (generic_function *) sys_remove},
+    [SYS_OPEN] = {1, (generic_function *) sys_open},
+    [SYS_FILESIZE] = {1, (generic_function *) sys_filesize},
+    [SYS_READ] = {3, (generic_function *) sys_read},
+    [SYS_WRITE] = {3, (generic_function *) sys_write},
+    [SYS_SEEK] = {2, (generic_function *) sys_seek},
+    [SYS_TELL] = {1, (generic_function *) sys_tell},
+    [SYS_CLOSE] = {1, (generic_function *) sys_close},
+    [SYS_MMAP] = {2, (generic_function *) sys_mmap},
+    [SYS_MUNMAP] = {1, (generic_function *) sys_munmap},
+    [SYS_CHDIR] = {1, (generic_function *) sys_chdir},
+    [SYS_MKDIR] = {1, (generic_function *) sys_mkdir},
+    [SYS_READDIR] = {2, (generic_function *) sys_readdir},
+    [SYS_ISDIR] = {1, (generic_function *) sys_isdir},
+    [SYS_INUMBER] = {1, (generic_function *) sys_inumber},
+  };
+
+/* Most arguments that a system call takes. */
+#define SYSCALL_ARGS_MAX 3
 
 void
 syscall_init (void) 
@@ -12,9 +104,519 @@ syscall_init (void)
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
+/* Accessing user memory.
+
+   Rather than looking up every user address in the page
+   directory before touching it, the kernel just checks that the
+   address is below PHYS_BASE and accesses it.  If the page is
+   not mapped, the access page faults, and page_fault() resumes
+   the kernel at the address that was in %eax, with %eax set to
+   -1.  Each accessor loads the address of the instruction that
+   follows its access into %eax first, so it sees %eax == -1 if
+   and only if the access faulted.  The common case, a valid
+   pointer, thus costs one ordinary memory access.
+
+   page_fault() only does this while the running thread's
+   user_access flag is set, which the accessors set around their
+   access.  Any other kernel fault, such as a null pointer
+   dereference, is still a kernel bug and panics. */
+
+/* Copies the 32-bit word at user address USRC, which must be
+   below PHYS_BASE, to *DST.  Returns true if successful, false
+   if a page fault occurred. */
+static inline bool
+get_user_word (uint32_t *dst, const uint32_t *usrc) 
+{
+  struct thread *t = thread_current ();
+  int eax;
+  uint32_t word;
+
+  t->user_access = true;
+  barrier ();
+  asm volatile ("movl $1f, %%eax; movl %2, %1; 1:"
+                : "=&a" (eax), "=&r" (word) : "m" (*usrc));
+  barrier ();
+  t->user_access = false;
+  if (eax == -1)
+    return false;
+  *dst = word;
+  return true;
+}
+
+/* Copies the byte at user address USRC, which must be below
+   PHYS_BASE, to *DST.  Returns true if successful, false if a
+   page fault occurred. */
+static inline bool
+get_user (uint8_t *dst, const uint8_t *usrc) 
+{
+  struct thread *t = thread_current ();
+  int eax;
+
+  t->user_access = true;
+  barrier ();
+  asm volatile ("movl $1f, %%eax; movb %2, %%al; movb %%al, %0; 1:"
+                : "=m" (*dst), "=&a" (eax) : "m" (*usrc));
+  barrier ();
+  t->user_access = false;
+  return eax != -1;
+}
+
+/* Writes BYTE to user address UDST, which must be below
+   PHYS_BASE.  Returns true if successful, false if a page fault
+   occurred. */
+static inline bool
+put_user (uint8_t *udst, uint8_t byte) 
+{
+  struct thread *t = thread_current ();
+  int eax;
+
+  t->user_access = true;
+  barrier ();
+  asm volatile ("movl $1f, %%eax; movb %b2, %0; 1:"
+                : "=m" (*udst), "=&a" (eax) : "q" (byte));
+  barrier ();
+  t->user_access = false;
+  return eax != -1;
+}
+
+/* Terminates the running process with exit status -1, because
+   it passed a bad pointer or made a bad system call. */
+static void
+kill_process (void) 
+{
+  thread_current ()->exit_status = -1;
+  thread_exit ();
+}
+
+/* Copies CNT 32-bit words from user address USRC to DST.
+   Terminates the process if any of them is not mapped. */
+static void
+copy_in_words (uint32_t *dst, const uint32_t *usrc, size_t cnt) 
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (!is_user_vaddr ((const uint8_t *) (usrc + i) + 3)
+        || !get_user_word (dst + i, usrc + i))
+      kill_process ();
+}
+
+/* Copies the null-terminated string at user address USRC into a
+   new page and returns it.  The caller must free the page with
+   palloc_free_page().  Terminates the process if the string is
+   not mapped, and truncates it to PGSIZE - 1 bytes. */
+static char *
+copy_in_string (const char *usrc) 
+{
+  char *ks = palloc_get_page (0);
+  size_t i;
+
+  if (ks == NULL)
+    kill_process ();
+  for (i = 0; i < PGSIZE - 1; i++)
+    {
+      if (!is_user_vaddr (usrc + i)
+          || !get_user ((uint8_t *) ks + i, (const uint8_t *) usrc + i))
+        {
+          palloc_free_page (ks);
+          kill_process ();
+        }
+      if (ks[i] == '\0')
+        return ks;
+    }
+  ks[i] = '\0';
+  return ks;
+}
+
+/* Copies SIZE bytes from SRC to user address UDST.  Terminates
+   the process if UDST is not mapped. */
 static void
-syscall_handler (struct intr_frame *f UNUSED) 
+copy_out (uint8_t *udst, const uint8_t *src, size_t size) 
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (!is_user_vaddr (udst + i) || !put_user (udst + i, src[i]))
+      kill_process ();
+}
+
+/* System call handler. */
+static void
+syscall_handler (struct intr_frame *f) 
+{
+  uint32_t args[SYSCALL_ARGS_MAX];
+  const struct syscall *sc;
+  uint32_t call_nr;
+
+  copy_in_words (&call_nr, f->esp, 1);
+  if (call_nr >= sizeof syscall_table / sizeof *syscall_table
+      || syscall_table[call_nr].func == NULL)
+    kill_process ();
+  sc = &syscall_table[call_nr];
+
+  ASSERT (sc->arg_cnt <= SYSCALL_ARGS_MAX);
+  memset (args, 0, sizeof args);
+  copy_in_words (args, (uint32_t *) f->esp + 1, sc->arg_cnt);
+  f->eax = ((syscall_function *) sc->func) (args[0], args[1], args[2]);
+}
+
+/* Closes every file that the running process has open.  Called
+   by process_exit(). */
+void
+syscall_exit (void) 
+{
+  struct list *fds = &thread_current ()->fds;
+
+  while (!list_empty (fds))
+    {
+      struct fd *fd = list_entry (list_front (fds), struct fd, elem);
+      sys_close (fd->fd);
+    }
+}
+
+/* Returns the running process's file descriptor FD, or a null
+   pointer if it has none. */
+static struct fd *
+lookup_fd (int fd) 
+{
+  struct list *fds = &thread_current ()->fds;
+  struct list_elem *e;
+
+  for (e = list_begin (fds); e != list_end (fds); e = list_next (e))
+    {
+      struct fd *d = list_entry (e, struct fd, elem);
+      if (d->fd == fd)
+        return d;
+    }
+  return NULL;
+}
+
+/* Returns the running process's file descriptor FD if it is an
+   open file that is not a directory, or a null pointer. */
+static struct fd *
+lookup_file_fd (int fd) 
+{
+  struct fd *d = lookup_fd (fd);
+  return d != NULL && d->dir == NULL ? d : NULL;
+}
+
+/* Returns true if the SIZE bytes at user address UBUF are all
+   mapped in the running process, and writable if WRITABLE. */
+static bool
+user_buffer_ok (const uint8_t *ubuf, unsigned size, bool writable) 
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  const uint8_t *upage;
+
+  if (size == 0)
+    return true;
+  if (ubuf + size < ubuf || !is_user_vaddr (ubuf + size - 1))
+    return false;
+  for (upage = pg_round_down (ubuf); upage < ubuf + size; upage += PGSIZE)
+    if (writable
+        ? !pagedir_is_writable (pd, upage)
+        : pagedir_get_page (pd, upage) == NULL)
+      return false;
+  return true;
+}
+
+/* Moves SIZE bytes between FILE, at its current position, and
+   the user buffer UBUF: from FILE into UBUF if READING, the
+   other way otherwise.
+
+   Instead of copying through a kernel buffer, the user pages
+   are translated with pagedir_get_page() and their kernel
+   addresses handed to the file system, which moves runs of whole
+   sectors straight between the disk and the pages (see
+   inode_read_at()).  Pages that are adjacent in physical memory
+   are passed together, so that their sectors form one run.
+   User pages are never evicted in this kernel, and a process
+   has only one thread, so the pages stay mapped throughout.
+
+   UBUF must already have been checked with user_buffer_ok().
+   Returns the number of bytes moved, which is short at end of
+   file. */
+static int
+file_io (struct file *file, void *ubuf_, unsigned size, bool reading) 
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  uint8_t *ubuf = ubuf_;
+  unsigned done = 0;
+
+  while (done < size)
+    {
+      uint8_t *kaddr = pagedir_get_page (pd, ubuf + done);
+      unsigned chunk = PGSIZE - pg_ofs (ubuf + done);
+      off_t moved;
+
+      /* Extend the chunk over physically adjacent pages. */
+      while (chunk < size - done
+             && pagedir_get_page (pd, ubuf + done + chunk) == kaddr + chunk)
+        chunk += PGSIZE;
+      if (chunk > size - done)
+        chunk = size - done;
+
+      moved = (reading
+               ? file_read (file, kaddr, chunk)
+               : file_write (file, kaddr, chunk));
+      done += moved;
+      if ((unsigned) moved < chunk)
+        break;
+    }
+  return done;
+}
+
+/* Halt system call. */
+static int
+sys_halt (void) 
+{
+  shutdown_power_off ();
+}
+
+/* Exit system call. */
+static int
+sys_exit (int status) 
 {
-  printf ("system call!\n");
+  thread_current ()->exit_status = status;
   thread_exit ();
 }
+
+/* Exec system call. */
+static int
+sys_exec (const char *ucmd_line) 
+{
+  char *cmd_line = copy_in_string (ucmd_line);
+  tid_t tid = process_execute (cmd_line);
+
+  palloc_free_page (cmd_line);
+  return tid;
+}
+
+/* Wait system call. */
+static int
+sys_wait (tid_t child) 
+{
+  return process_wait (child);
+}
+
+/* Create system call. */
+static int
+sys_create (const char *ufile, unsigned initial_size) 
+{
+  char *file = copy_in_string (ufile);
+  bool ok = filesys_create (file, initial_size);
+
+  palloc_free_page (file);
+  return ok;
+}
+
+/* Remove system call. */
+static int
+sys_remove (const char *ufile) 
+{
+  char *file = copy_in_string (ufile);
+  bool ok = filesys_remove (file);
+
+  palloc_free_page (file);
+  return ok;
+}
+
+/* Open system call. */
+static int
+sys_open (const char *ufile) 
+{
+  char *file = copy_in_string (ufile);
+  struct fd *d;
+  int fd = -1;
+
+  d = malloc (sizeof *d);
+  if (d != NULL)
+    {
+      d->file = filesys_open (file);
+      d->dir = NULL;
+      if (d->file != NULL
+          && inode_is_dir (file_get_inode (d->file)))
+        {
+          d->dir = dir_open (inode_reopen (file_get_inode (d->file)));
+          if (d->dir == NULL)
+            {
+              file_close (d->file);
+              d->file = NULL;
+            }
+        }
+      if (d->file != NULL)
+        {
+          struct thread *cur = thread_current ();
+          fd = d->fd = cur->next_fd++;
+          list_push_front (&cur->fds, &d->elem);
+        }
+      else
+        free (d);
+    }
+  palloc_free_page (file);
+  return fd;
+}
+
+/* Filesize system call. */
+static int
+sys_filesize (int fd) 
+{
+  struct fd *d = lookup_fd (fd);
+  return d != NULL ? file_length (d->file) : -1;
+}
+
+/* Read system call. */
+static int
+sys_read (int fd, void *ubuf_, unsigned size) 
+{
+  uint8_t *ubuf = ubuf_;
+  struct fd *d;
+
+  if (fd == STDIN_FILENO)
+    {
+      unsigned i;
+
+      for (i = 0; i < size; i++)
+        {
+          uint8_t c = input_getc ();
+          copy_out (ubuf + i, &c, 1);
+        }
+      return size;
+    }
+
+  d = lookup_file_fd (fd);
+  if (d == NULL)
+    return -1;
+  if (size > 0 && !user_buffer_ok (ubuf, size, true))
+    kill_process ();
+  return file_io (d->file, ubuf, size, true);
+}
+
+/* Write system call. */
+static int
+sys_write (int fd, const void *ubuf_, unsigned size) 
+{
+  const uint8_t *ubuf = ubuf_;
+  struct fd *d;
+
+  if (size > 0 && !user_buffer_ok (ubuf, size, false))
+    kill_process ();
+
+  if (fd == STDOUT_FILENO)
+    {
+      /* The buffer is mapped, so the console can read it
+         directly. */
+      putbuf ((const char *) ubuf, size);
+      return size;
+    }
+
+  d = lookup_file_fd (fd);
+  if (d == NULL)
+    return -1;
+  return file_io (d->file, (void *) ubuf, size, false);
+}
+
+/* Seek system call. */
+static int
+sys_seek (int fd, unsigned position) 
+{
+  struct fd *d = lookup_file_fd (fd);
+
+  /* Positions past the largest off_t cannot be represented, and
+     file_seek() would take them for negative offsets. */
+  if (d != NULL && position <= INT32_MAX)
+    file_seek (d->file, position);
+  return 0;
+}
+
+/* Tell system call. */
+static int
+sys_tell (int fd) 
+{
+  struct fd *d = lookup_file_fd (fd);
+  return d != NULL ? file_tell (d->file) : -1;
+}
+
+/* Close system call. */
+static int
+sys_close (int fd) 
+{
+  struct fd *d = lookup_fd (fd);
+
+  if (d != NULL)
+    {
+      list_remove (&d->elem);
+      dir_close (d->dir);
+      file_close (d->file);
+      free (d);
+    }
+  return 0;
+}
+
+/* Mmap system call.  This kernel has no virtual memory
+   subsystem to page a mapping in from, so it always fails. */
+static int
+sys_mmap (int fd UNUSED, void *addr UNUSED) 
+{
+  return -1;
+}
+
+/* Munmap system call.  No mapping can exist, so there is
+   nothing to do. */
+static int
+sys_munmap (int mapping UNUSED) 
+{
+  return 0;
+}
+
+/* Chdir system call. */
+static int
+sys_chdir (const char *udir) 
+{
+  char *dir = copy_in_string (udir);
+  bool ok = filesys_chdir (dir);
+
+  palloc_free_page (dir);
+  return ok;
+}
+
+/* Mkdir system call. */
+static int
+sys_mkdir (const char *udir) 
+{
+  char *dir = copy_in_string (udir);
+  bool ok = filesys_mkdir (dir);
+
+  palloc_free_page (dir);
+  return ok;
+}
+
+/* Readdir system call. */
+static int
+sys_readdir (int fd, char *uname) 
+{
+  struct fd *d = lookup_fd (fd);
+  char name[NAME_MAX + 1];
+
+  if (d == NULL || d->dir == NULL || !dir_readdir (d->dir, name))
+    return false;
+  copy_out ((uint8_t *) uname, (const uint8_t *) name,
+            strnlen (name, READDIR_MAX_LEN) + 1);
+  return true;
+}
+
+/* Isdir system call. */
+static int
+sys_isdir (int fd) 
+{
+  struct fd *d = lookup_fd (fd);
+  return d != NULL && d->dir != NULL;
+}
+
+/* Inumber system call. */
+static int
+sys_inumber (int fd) 
+{
+  struct fd *d = lookup_fd (fd);
+  return d != NULL ? (int) inode_get_inumber (file_get_inode (d->file)) : -1;
+}